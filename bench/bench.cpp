@@ -0,0 +1,473 @@
+// Microbenchmarks against the std smart pointers.
+// Built once per counting mode, see CMakeLists.txt. Prints one CSV row per measurement to stdout
+// or to the file given as the first argument:
+//     mode,benchmark,threads,ops,ns_per_op,mops_per_s
+// `ns_per_op` is the wall time one thread spent per operation, `mops_per_s` the throughput of
+// all threads together.
+
+#include "../shared-ptr/shared.h"
+#include "../shared-ptr/weak.h"
+#include "../shared-ptr/atomic_shared.h"
+#include "../shared-ptr/local_shared.h"
+#include "../shared-ptr/rcu_cell.h"
+#include "../intrusive-ptr/intrusive.h"
+#include "../unique-ptr/unique.h"
+#include "../unique-ptr/deferred_delete.h"
+
+#include <algorithm>  // std::max, std::shuffle, std::sort
+#include <atomic>
+#include <chrono>
+#include <cstddef>  // size_t
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>  // std::move
+#include <vector>
+
+#if defined(SMART_PTRS_PACKED_COUNTERS)
+constexpr const char* kMode = "packed";
+#elif defined(SMART_PTRS_BIASED_COUNTERS)
+constexpr const char* kMode = "biased";
+#elif defined(SMART_PTRS_POOL_CONTROL_BLOCKS)
+constexpr const char* kMode = "pool";
+#elif defined(SMART_PTRS_INSTRUMENT)
+constexpr const char* kMode = "instrument";
+#else
+constexpr const char* kMode = "default";
+#endif
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Harness
+
+using Clock = std::chrono::steady_clock;
+
+double Since(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// Keeps the compiler from dropping the work that produced `ptr`
+inline void Escape(const void* ptr) {
+    asm volatile("" : : "r"(ptr) : "memory");
+}
+
+class Reporter {
+public:
+    explicit Reporter(FILE* out) : out_(out) {
+        std::fprintf(out_, "mode,benchmark,threads,ops,ns_per_op,mops_per_s\n");
+    }
+
+    // `fn(ops)` performs `ops` operations; the best of a few runs is reported
+    template <class Fn>
+    void Run(const char* name, size_t ops, Fn fn) {
+        fn(ops / 10);  // warm up caches and pools
+        double best = 0;
+        for (int run = 0; run < kRuns; ++run) {
+            auto start = Clock::now();
+            fn(ops);
+            double ns = Since(start);
+            best = run == 0 ? ns : std::min(best, ns);
+        }
+        Add(name, 1, ops, best);
+    }
+
+    // `fn(thread, ops)` runs on `threads` threads at once, each performing `ops` operations
+    template <class Fn>
+    void RunThreads(const char* name, size_t threads, size_t ops, Fn fn) {
+        std::atomic<size_t> ready = 0;
+        std::atomic<bool> go = false;
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([&, i] {
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                fn(i, ops);
+            });
+        }
+        while (ready.load() != threads) {
+            std::this_thread::yield();
+        }
+        auto start = Clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        Add(name, threads, ops, Since(start));
+    }
+
+    // `ns` is the wall time `threads` threads took for `ops` operations each
+    void Add(const char* name, size_t threads, size_t ops, double ns) {
+        std::fprintf(out_, "%s,%s,%zu,%zu,%.3f,%.3f\n", kMode, name, threads, ops, ns / ops,
+                     threads * ops / ns * 1e3);
+        std::fflush(out_);
+    }
+
+private:
+    static constexpr int kRuns = 3;
+
+    FILE* out_;
+};
+
+// 1, 2, 4, ... up to the number of cores, and the number of cores itself
+std::vector<size_t> ThreadCounts() {
+    size_t cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    std::vector<size_t> counts;
+    for (size_t threads = 1; threads < cores; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(cores);
+    return counts;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Payloads
+
+struct Payload {
+    explicit Payload(int value = 0) : value(value) {
+    }
+    int value;
+};
+
+struct SelfShared : EnableSharedFromThis<SelfShared> {
+    int value = 0;
+};
+struct StdSelfShared : std::enable_shared_from_this<StdSelfShared> {
+    int value = 0;
+};
+
+struct Hot {
+    int value = 0;
+};
+
+struct Counted : ThreadSafeRefCounted<Counted> {
+    int value = 0;
+};
+struct ShardedCounted : ShardedRefCounted<ShardedCounted> {
+    int value = 0;
+};
+
+// Something whose destructor is worth moving off the releasing thread
+struct Graph {
+    Graph() : nodes(256) {
+        for (auto& node : nodes) {
+            node = std::make_unique<Payload>();
+        }
+    }
+    std::vector<std::unique_ptr<Payload>> nodes;
+};
+
+}  // namespace
+
+template <>
+struct ShardedRefCount<Hot> : std::true_type {};
+
+namespace {
+
+constexpr size_t kOps = 1'000'000;
+constexpr size_t kThreadOps = 200'000;
+constexpr size_t kVectorSize = 4096;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Single thread
+
+// Construct, copy, move and destroy
+template <class Ptr, class Make>
+void Lifetime(Reporter& reporter, const std::string& prefix, Make make) {
+    reporter.Run((prefix + " make+drop").c_str(), kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            Ptr ptr = make();
+            Escape(&ptr);
+        }
+    });
+    Ptr shared = make();
+    reporter.Run((prefix + " copy+drop").c_str(), kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            Ptr copy = shared;
+            Escape(&copy);
+        }
+    });
+    reporter.Run((prefix + " move").c_str(), kOps, [&](size_t ops) {
+        Ptr first = shared;
+        for (size_t i = 0; i < ops; ++i) {
+            Ptr second = std::move(first);
+            Escape(&second);
+            first = std::move(second);
+        }
+    });
+}
+
+template <class Ptr, class Make>
+void UniqueLifetime(Reporter& reporter, const std::string& prefix, Make make) {
+    reporter.Run((prefix + " make+drop").c_str(), kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            Ptr ptr = make();
+            Escape(&ptr);
+        }
+    });
+    reporter.Run((prefix + " move").c_str(), kOps, [&](size_t ops) {
+        Ptr first = make();
+        for (size_t i = 0; i < ops; ++i) {
+            Ptr second = std::move(first);
+            Escape(&second);
+            first = std::move(second);
+        }
+    });
+}
+
+template <class Shared, class Weak, class Lock>
+void WeakLock(Reporter& reporter, const std::string& prefix, Shared shared, Lock lock) {
+    Weak weak(shared);
+    reporter.Run((prefix + " lock hit").c_str(), kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            auto locked = lock(weak);
+            Escape(&locked);
+        }
+    });
+    shared = Shared();
+    reporter.Run((prefix + " lock miss").c_str(), kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            auto locked = lock(weak);
+            Escape(&locked);
+        }
+    });
+}
+
+// Growing a vector moves every element over, sorting swaps them around
+template <class Ptr, class Make>
+void Vectors(Reporter& reporter, const std::string& prefix, Make make) {
+    std::mt19937 random(42);
+    reporter.Run((prefix + " vector grow").c_str(), kVectorSize * 100, [&](size_t ops) {
+        for (size_t done = 0; done < ops; done += kVectorSize) {
+            std::vector<Ptr> grown;
+            for (size_t i = 0; i < kVectorSize; ++i) {
+                grown.push_back(make(0));
+            }
+            Escape(grown.data());
+        }
+    });
+    std::vector<Ptr> pointers;
+    for (size_t i = 0; i < kVectorSize; ++i) {
+        pointers.push_back(make(static_cast<int>(random())));
+    }
+    reporter.Run((prefix + " vector shuffle+sort").c_str(), kVectorSize * 100, [&](size_t ops) {
+        for (size_t done = 0; done < ops; done += kVectorSize) {
+            std::shuffle(pointers.begin(), pointers.end(), random);
+            std::sort(pointers.begin(), pointers.end(),
+                      [](const Ptr& left, const Ptr& right) { return left->value < right->value; });
+            Escape(pointers.data());
+        }
+    });
+}
+
+void SingleThread(Reporter& reporter) {
+    Lifetime<SharedPtr<Payload>>(reporter, "SharedPtr MakeShared",
+                                 [] { return MakeShared<Payload>(); });
+    Lifetime<std::shared_ptr<Payload>>(reporter, "std::shared_ptr make_shared",
+                                       [] { return std::make_shared<Payload>(); });
+    Lifetime<SharedPtr<Payload>>(reporter, "SharedPtr adopt",
+                                 [] { return SharedPtr<Payload>(new Payload); });
+    Lifetime<std::shared_ptr<Payload>>(reporter, "std::shared_ptr adopt",
+                                       [] { return std::shared_ptr<Payload>(new Payload); });
+    Lifetime<LocalSharedPtr<Payload>>(reporter, "LocalSharedPtr MakeLocalShared",
+                                      [] { return MakeLocalShared<Payload>(); });
+    Lifetime<IntrusivePtr<Counted>>(reporter, "IntrusivePtr MakeIntrusive",
+                                    [] { return MakeIntrusive<Counted>(); });
+    UniqueLifetime<UniquePtr<Payload>>(reporter, "UniquePtr",
+                                       [] { return UniquePtr<Payload>(new Payload); });
+    UniqueLifetime<std::unique_ptr<Payload>>(reporter, "std::unique_ptr",
+                                             [] { return std::make_unique<Payload>(); });
+
+    WeakLock<SharedPtr<Payload>, WeakPtr<Payload>>(
+        reporter, "WeakPtr", MakeShared<Payload>(),
+        [](const WeakPtr<Payload>& weak) { return weak.Lock(); });
+    WeakLock<std::shared_ptr<Payload>, std::weak_ptr<Payload>>(
+        reporter, "std::weak_ptr", std::make_shared<Payload>(),
+        [](const std::weak_ptr<Payload>& weak) { return weak.lock(); });
+
+    // Dropping a reference that is not the last one, on the block's own counter: one decrement
+    // now, against the weak increment, strong decrement and weak decrement it used to take
+    SharedCounter counter;
+    reporter.Run("SharedCounter release", kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            counter.IncStrong();
+            counter.DecStrong({});
+            Escape(&counter);
+        }
+    });
+    reporter.Run("SharedCounter release with weak guard", kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            counter.IncStrong();
+            counter.IncWeak();
+            counter.DecStrong({});
+            counter.DecWeak();
+            Escape(&counter);
+        }
+    });
+
+    auto self = MakeShared<SelfShared>();
+    reporter.Run("SharedPtr SharedFromThis", kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            auto ptr = self->SharedFromThis();
+            Escape(&ptr);
+        }
+    });
+    auto std_self = std::make_shared<StdSelfShared>();
+    reporter.Run("std::shared_ptr shared_from_this", kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+            auto ptr = std_self->shared_from_this();
+            Escape(&ptr);
+        }
+    });
+
+    Vectors<SharedPtr<Payload>>(reporter, "SharedPtr",
+                                [](int value) { return MakeShared<Payload>(value); });
+    Vectors<std::shared_ptr<Payload>>(reporter, "std::shared_ptr",
+                                      [](int value) { return std::make_shared<Payload>(value); });
+    Vectors<UniquePtr<Payload>>(reporter, "UniquePtr", [](int value) {
+        return UniquePtr<Payload>(new Payload(value));
+    });
+
+    // Only the releases are timed: inline they run the whole destructor chain, deferred they
+    // only queue the graph for a later `Drain`
+    constexpr size_t kGraphs = 2000;
+    auto release = [&](const char* name, auto make) {
+        std::vector<SharedPtr<Graph>> graphs(kGraphs);
+        for (auto& graph : graphs) {
+            graph = make();
+        }
+        auto start = Clock::now();
+        for (auto& graph : graphs) {
+            graph.Reset();
+        }
+        reporter.Add(name, 1, kGraphs, Since(start));
+    };
+    release("SharedPtr<Graph> inline release", [] { return MakeShared<Graph>(); });
+    release("SharedPtr<Graph> deferred release",
+            [] { return SharedPtr<Graph>(new Graph, DeferredDelete<Graph>()); });
+    auto start = Clock::now();
+    DeferredReclaimer::Default().Drain();
+    reporter.Add("DeferredReclaimer Drain", 1, kGraphs, Since(start));
+
+#ifdef SMART_PTRS_POOL_CONTROL_BLOCKS
+    BlockPoolStats pool = BlockPool::GetStats();
+    std::fprintf(stderr, "pool: %zu allocations, hit rate %.3f\n", pool.allocations,
+                 pool.HitRate());
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Many threads
+
+// Every thread keeps copying and dropping one object made on the main thread
+template <class Ptr>
+void FanOut(Reporter& reporter, const char* name, const Ptr& shared) {
+    for (size_t threads : ThreadCounts()) {
+        reporter.RunThreads(name, threads, kThreadOps, [&](size_t, size_t ops) {
+            for (size_t i = 0; i < ops; ++i) {
+                Ptr copy = shared;
+                Escape(&copy);
+            }
+        });
+    }
+}
+
+// Readers keep loading a published value while one writer replaces it
+template <class Load, class Store>
+void Publish(Reporter& reporter, const char* name, Load load, Store store) {
+    for (size_t threads : ThreadCounts()) {
+        std::atomic<bool> done = false;
+        std::thread writer([&] {
+            for (int version = 0; !done.load(std::memory_order_relaxed); ++version) {
+                store(version);
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        });
+        reporter.RunThreads(name, threads, kThreadOps, [&](size_t, size_t ops) {
+            for (size_t i = 0; i < ops; ++i) {
+                load();
+            }
+        });
+        done.store(true);
+        writer.join();
+    }
+}
+
+void ManyThreads(Reporter& reporter) {
+    FanOut(reporter, "SharedPtr fan-out", MakeShared<Payload>());
+    FanOut(reporter, "std::shared_ptr fan-out", std::make_shared<Payload>());
+    FanOut(reporter, "IntrusivePtr fan-out", MakeIntrusive<Counted>());
+
+    SharedPtr<Hot> hot = MakeShared<Hot>();
+    FanOut(reporter, "SharedPtr sharded fan-out", hot);
+    hot.SwitchToAtomic();
+    IntrusivePtr<ShardedCounted> sharded = MakeIntrusive<ShardedCounted>();
+    FanOut(reporter, "IntrusivePtr sharded fan-out", sharded);
+    sharded->SwitchToAtomic();
+
+    AtomicSharedPtr<const Payload> atomic(MakeShared<const Payload>());
+    Publish(
+        reporter, "AtomicSharedPtr Load",
+        [&] {
+            SharedPtr<const Payload> value = atomic.Load();
+            Escape(value.Get());
+        },
+        [&](int version) { atomic.Store(MakeShared<const Payload>(version)); });
+
+    std::mutex mutex;
+    SharedPtr<const Payload> locked = MakeShared<const Payload>();
+    Publish(
+        reporter, "mutex SharedPtr copy",
+        [&] {
+            std::lock_guard<std::mutex> lock(mutex);
+            SharedPtr<const Payload> value = locked;
+            Escape(value.Get());
+        },
+        [&](int version) {
+            SharedPtr<const Payload> next = MakeShared<const Payload>(version);
+            std::lock_guard<std::mutex> lock(mutex);
+            locked.Swap(next);
+        });
+
+    RcuCell<Payload> cell;
+    Publish(
+        reporter, "RcuCell Read",
+        [&] {
+            auto guard = cell.Read();
+            Escape(guard.Get());
+        },
+        [&](int version) { cell.Update([version](Payload& payload) { payload.value = version; }); });
+    Publish(
+        reporter, "RcuCell Load",
+        [&] {
+            SharedPtr<const Payload> value = cell.Load();
+            Escape(value.Get());
+        },
+        [&](int version) { cell.Update([version](Payload& payload) { payload.value = version; }); });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    FILE* out = argc > 1 ? std::fopen(argv[1], "w") : stdout;
+    if (!out) {
+        std::perror(argv[1]);
+        return 1;
+    }
+    // libstdc++ skips the atomics of `std::shared_ptr` for as long as the process has never had a
+    // second thread, which would make the single-thread rows compare against non-atomic counts
+    std::thread([] {}).join();
+    {
+        Reporter reporter(out);
+        SingleThread(reporter);
+        ManyThreads(reporter);
+    }
+    if (out != stdout) {
+        std::fclose(out);
+    }
+}
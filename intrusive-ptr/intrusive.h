@@ -1,26 +1,123 @@
 #pragma once
 
+#include "../shared-ptr/sharded_count.h"
+#include "../unique-ptr/instrument.h"
+
+#include <atomic>   // for std::atomic
 #include <cstddef>  // for std::nullptr_t
 #include <utility>  // for std::exchange / std::swap
 
+// Counts with the top bit set belong to immortal objects: they never change again, so the
+// object is never destroyed. A counter that would overflow saturates there too.
+constexpr size_t kImmortalRefCount = ~(~size_t(0) >> 1);
+
 class SimpleCounter {
 public:
     size_t IncRef() {
-        ++count_;
+        if (!(count_ & kImmortalRefCount)) {
+            ++count_;
+        }
         return count_;
     }
     size_t DecRef() {
-        --count_;
+        if (!(count_ & kImmortalRefCount)) {
+            --count_;
+        }
         return count_;
     }
+    // 1 for immortal objects, as with `SharedPtr::UseCount`
     size_t RefCount() const {
-        return count_;
+        return count_ & kImmortalRefCount ? 1 : count_;
+    }
+    void MakeImmortal() {
+        count_ |= kImmortalRefCount;
     }
 
 private:
     size_t count_ = 0;
 };
 
+class AtomicCounter {
+public:
+    AtomicCounter() = default;
+    // A copy of an object is a new object, nobody references it yet
+    AtomicCounter(const AtomicCounter&){};
+    AtomicCounter& operator=(const AtomicCounter&) {
+        return *this;
+    }
+
+    // Immortal objects only read the counter, so its cache line is shared by all cores instead
+    // of moving between them
+    size_t IncRef() {
+        size_t count = count_.load(std::memory_order_relaxed);
+        if (count & kImmortalRefCount) {
+            return count;
+        }
+        return count_.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    // Every access made through other references happens-before the destruction
+    // performed by whoever drops the counter to zero
+    size_t DecRef() {
+        size_t count = count_.load(std::memory_order_relaxed);
+        if (count & kImmortalRefCount) {
+            return count;
+        }
+        return count_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    }
+    // 1 for immortal objects, as with `SharedPtr::UseCount`
+    size_t RefCount() const {
+        size_t count = count_.load(std::memory_order_acquire);
+        return count & kImmortalRefCount ? 1 : count;
+    }
+    // A racing update that missed the bit still leaves it set
+    void MakeImmortal() {
+        count_.fetch_or(kImmortalRefCount, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<size_t> count_ = 0;
+};
+
+// For a few objects that nearly every thread keeps referencing, see `ShardedCount`.
+// The object is never destroyed before `RefCounted::SwitchToAtomic` is called.
+class ShardedCounter {
+public:
+    ShardedCounter() = default;
+    // Like `AtomicCounter`: the copy starts with no references of its own
+    ShardedCounter(const ShardedCounter&){};
+    ShardedCounter& operator=(const ShardedCounter&) {
+        return *this;
+    }
+
+    // 1 for the first reference, which instrumented builds file as the allocation, and 2 after
+    // that. The total is never added up here: that would read every slot on every increment.
+    size_t IncRef() {
+        count_.Inc();
+#ifdef SMART_PTRS_INSTRUMENT
+        if (!referenced_.load(std::memory_order_relaxed) &&
+            !referenced_.exchange(true, std::memory_order_relaxed)) {
+            return 1;
+        }
+#endif
+        return 2;
+    }
+    size_t DecRef() {
+        return count_.Dec();
+    }
+    size_t RefCount() const {
+        return count_.Count();
+    }
+    size_t SwitchToAtomic() {
+        return count_.SwitchToAtomic();
+    }
+
+private:
+    ShardedCount count_{0};
+#ifdef SMART_PTRS_INSTRUMENT
+    std::atomic<bool> referenced_ = false;
+#endif
+};
+
 struct DefaultDelete {
     template <typename T>
     static void Destroy(T* object) {
@@ -33,23 +130,57 @@ class RefCounted {
 public:
     // Increase reference counter.
     void IncRef() {
+#ifdef SMART_PTRS_INSTRUMENT
+        size_t count = counter_.IncRef();
+        size_t id = RefInstrument::Id<Derived>();
+        // Like the control blocks, the first reference comes with the allocation
+        if (count == 1) {
+            RefInstrument::Count(id, RefInstrument::kAllocations);
+        } else if (RefInstrument::CountIncrement(id)) {
+            RefInstrument::SeenUseCount(id, counter_.RefCount());
+        }
+#else
         counter_.IncRef();
+#endif
     }
 
     // Decrease reference counter.
     // Destroy object using Deleter when the last instance dies.
     void DecRef() {
-        counter_.DecRef();
-        if (counter_.RefCount() == 0) {
+#ifdef SMART_PTRS_INSTRUMENT
+        RefInstrument::Count(RefInstrument::Id<Derived>(), RefInstrument::kDecrements);
+#endif
+        if (counter_.DecRef() == 0) {
+#ifdef SMART_PTRS_INSTRUMENT
+            RefInstrument::Count(RefInstrument::Id<Derived>(), RefInstrument::kFrees);
+#endif
             Deleter().Destroy(static_cast<Derived*>(this));
         }
     }
 
-    // Get current counter value (the number of strong references).
+    // Get current counter value (the number of strong references), always 1 for immortal
+    // objects.
     size_t RefCount() const {
         return counter_.RefCount();
     }
 
+    // Never destroy the object, and stop writing its counter. `SimpleCounter` and
+    // `AtomicCounter` only.
+    void MakeImmortal() {
+        counter_.MakeImmortal();
+    }
+
+    // Only for `ShardedCounter`: count in one place from now on, so that the last reference
+    // destroys the object.
+    void SwitchToAtomic() {
+        if (counter_.SwitchToAtomic() == 0) {
+#ifdef SMART_PTRS_INSTRUMENT
+            RefInstrument::Count(RefInstrument::Id<Derived>(), RefInstrument::kFrees);
+#endif
+            Deleter().Destroy(static_cast<Derived*>(this));
+        }
+    }
+
 private:
     Counter counter_;
 };
@@ -57,6 +188,12 @@ private:
 template <typename Derived, typename D = DefaultDelete>
 using SimpleRefCounted = RefCounted<Derived, SimpleCounter, D>;
 
+template <typename Derived, typename D = DefaultDelete>
+using ThreadSafeRefCounted = RefCounted<Derived, AtomicCounter, D>;
+
+template <typename Derived, typename D = DefaultDelete>
+using ShardedRefCounted = RefCounted<Derived, ShardedCounter, D>;
+
 template <typename T>
 class IntrusivePtr {
 public:
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "shared.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>  // uint64_t
+#include <utility>  // std::move
+
+// Node addresses are packed into the low 48 bits of a word. User-space heap addresses fit there on
+// x86-64 and AArch64, but not once AArch64 tags the top byte (MTE, Android heap tagging).
+#if !defined(__x86_64__) && !defined(_M_X64) && !defined(__aarch64__) && !defined(_M_ARM64)
+#error "AtomicSharedPtr needs 48-bit addresses: x86-64 or AArch64 only"
+#elif defined(__aarch64__) && (defined(__ANDROID__) || defined(__ARM_FEATURE_MEMORY_TAGGING))
+#error "AtomicSharedPtr cannot pack tagged AArch64 pointers"
+#endif
+
+// Instead of std::atomic<std::shared_ptr<T>>
+// Lock-free through split reference counting. The stored `SharedPtr` lives in a node, and
+// the atomic word packs the node address (low 48 bits) with a count of readers that are
+// currently copying out of it (high 16 bits). A reader bumps that local count, copies the
+// value and gives the count back; if the node was swapped out in the meantime, the writer
+// has already moved the outstanding local counts into the node's own counter instead.
+template <typename T>
+class AtomicSharedPtr {
+public:
+    AtomicSharedPtr() : word_(0){};
+    AtomicSharedPtr(SharedPtr<T> desired) : word_(Pack(MakeNode(std::move(desired)))){};
+    AtomicSharedPtr(const AtomicSharedPtr&) = delete;
+    AtomicSharedPtr& operator=(const AtomicSharedPtr&) = delete;
+
+    ~AtomicSharedPtr() {
+        uint64_t word = word_.load(std::memory_order_acquire);
+        Retire(Unpack(word), Borrowed(word));
+    }
+
+    SharedPtr<T> Load() const {
+        uint64_t word = word_.fetch_add(kBorrow, std::memory_order_acquire) + kBorrow;
+        Node* node = Unpack(word);
+        SharedPtr<T> ans;
+        if (node) {
+            ans = node->value;
+        }
+        GiveBack(node);
+        return ans;
+    }
+
+    void Store(SharedPtr<T> desired) {
+        Exchange(std::move(desired));
+    }
+
+    SharedPtr<T> Exchange(SharedPtr<T> desired) {
+        uint64_t old =
+            word_.exchange(Pack(MakeNode(std::move(desired))), std::memory_order_acq_rel);
+        Node* node = Unpack(old);
+        SharedPtr<T> ans;
+        if (node) {
+            ans = node->value;
+            Retire(node, Borrowed(old));
+        }
+        return ans;
+    }
+
+    // Same pointer and same owner as `expected`: store `desired` and return true.
+    // Otherwise load the current value into `expected` and return false.
+    bool CompareExchange(SharedPtr<T>& expected, SharedPtr<T> desired) {
+        Node* fresh = MakeNode(std::move(desired));
+        while (true) {
+            uint64_t word = word_.fetch_add(kBorrow, std::memory_order_acquire) + kBorrow;
+            Node* node = Unpack(word);
+            SharedPtr<T> current;
+            if (node) {
+                current = node->value;
+            }
+            if (!(current == expected && current.Get() == expected.Get())) {
+                GiveBack(node);
+                expected = std::move(current);
+                Unref(fresh, kBatch);
+                return false;
+            }
+            while (Unpack(word) == node) {
+                if (word_.compare_exchange_weak(word, Pack(fresh), std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+                    // Our own borrow goes back to the node together with the atomic's share
+                    Retire(node, Borrowed(word) - 1);
+                    return true;
+                }
+            }
+            GiveBack(node);
+        }
+    }
+
+    bool IsLockFree() const {
+        return word_.is_lock_free();
+    }
+
+private:
+    static_assert(sizeof(void*) == sizeof(uint64_t), "pointer packing needs 64-bit pointers");
+
+    static constexpr int kPointerBits = 48;
+    static constexpr uint64_t kPointerMask = (uint64_t(1) << kPointerBits) - 1;
+    static constexpr uint64_t kBorrow = uint64_t(1) << kPointerBits;
+    // References a node starts with on behalf of the atomic; more than the local count can hold
+    static constexpr uint64_t kBatch = uint64_t(1) << (64 - kPointerBits);
+
+    struct Node {
+        std::atomic<uint64_t> refs;
+        SharedPtr<T> value;
+    };
+
+    static Node* MakeNode(SharedPtr<T> value) {
+        if (!value && value.UseCount() == 0) {
+            return nullptr;
+        }
+        auto node = new Node{kBatch, std::move(value)};
+        assert((Pack(node) & ~kPointerMask) == 0 && "node address does not fit 48 bits");
+        return node;
+    }
+    static uint64_t Pack(Node* node) {
+        return reinterpret_cast<uint64_t>(node);
+    }
+    static Node* Unpack(uint64_t word) {
+        return reinterpret_cast<Node*>(word & kPointerMask);
+    }
+    static uint64_t Borrowed(uint64_t word) {
+        return word >> kPointerBits;
+    }
+    static void Unref(Node* node, uint64_t count) {
+        if (node && node->refs.fetch_sub(count, std::memory_order_acq_rel) == count) {
+            delete node;
+        }
+    }
+
+    // Give back a borrow taken on `node`: to the atomic word while it still holds the node,
+    // to the node itself once it has been swapped out
+    void GiveBack(Node* node) const {
+        uint64_t word = word_.load(std::memory_order_relaxed);
+        while (Unpack(word) == node && Borrowed(word) > 0) {
+            if (word_.compare_exchange_weak(word, word - kBorrow, std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+                return;
+            }
+        }
+        Unref(node, 1);
+    }
+
+    // `node` was just swapped out with `borrowed` readers still copying from it. They will unref
+    // it one by one, so drop the rest of the atomic's batch.
+    static void Retire(Node* node, uint64_t borrowed) {
+        Unref(node, kBatch - borrowed);
+    }
+
+    mutable std::atomic<uint64_t> word_;
+};
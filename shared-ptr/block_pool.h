@@ -0,0 +1,280 @@
+#pragma once
+
+#include "../unique-ptr/per_thread.h"
+
+#include <algorithm>  // std::max
+#include <atomic>
+#include <cstddef>  // size_t, std::max_align_t
+#include <mutex>
+#include <new>  // ::operator new, std::align_val_t
+#include <vector>
+
+// Thread-caching slab pool for small control blocks.
+// Every thread keeps a free list per size class and trades whole batches of blocks with the
+// central lists, so a block freed on another thread only costs a lock once per batch.
+// Slabs are never given back to the system.
+
+struct BlockPoolStats {
+    size_t allocations = 0;  // served by the pool
+    size_t hits = 0;         // served from the thread cache without taking a lock
+    size_t refills = 0;      // batches taken from the central lists
+    size_t slabs = 0;        // slabs requested from the global heap
+    size_t oversized = 0;    // too large or overaligned, went to the global heap
+    size_t deallocations = 0;
+
+    double HitRate() const {
+        return allocations ? static_cast<double>(hits) / allocations : 0.0;
+    }
+};
+
+class BlockPool {
+public:
+    static constexpr size_t kGranularity = 16;
+    static constexpr size_t kMaxSize = 256;
+    static constexpr size_t kBatchSize = 32;
+    static constexpr size_t kSlabSize = 64 * 1024;
+
+    static bool IsPooled(size_t size, size_t alignment) {
+        return size <= kMaxSize && alignment <= alignof(std::max_align_t);
+    }
+
+    static void* Allocate(size_t size) {
+        size_t size_class = SizeClass(size);
+        ThreadCache* cache = GetThreadCache();
+        if (!cache) {
+            // The thread is already exiting, go straight to the central list
+            FreeBlock* chain = GetCentral().Pop(size_class);
+            if (!chain) {
+                chain = GetCentral().CarveSlab(size_class);
+            }
+            if (chain->next) {
+                chain->next->count = chain->count - 1;
+                GetCentral().Push(size_class, chain->next);
+            }
+            return chain;
+        }
+        return cache->Allocate(size_class);
+    }
+
+    static void Deallocate(void* ptr, size_t size) {
+        size_t size_class = SizeClass(size);
+        auto block = static_cast<FreeBlock*>(ptr);
+        ThreadCache* cache = GetThreadCache();
+        if (!cache) {
+            block->next = nullptr;
+            block->count = 1;
+            GetCentral().Push(size_class, block);
+            return;
+        }
+        cache->Deallocate(size_class, block);
+    }
+
+    static void CountOversized() {
+        if (ThreadCache* cache = GetThreadCache()) {
+            BumpOwned(cache->stats.oversized);
+        }
+    }
+
+    // Totals over all live threads plus the ones that already exited
+    static BlockPoolStats GetStats() {
+        Central& central = GetCentral();
+        std::lock_guard<std::mutex> lock(central.stats_mutex);
+        BlockPoolStats ans = central.retired;
+        for (const ThreadCache* cache : central.caches) {
+            cache->stats.AddTo(ans);
+        }
+        return ans;
+    }
+
+private:
+    static constexpr size_t kClasses = kMaxSize / kGranularity;
+
+    // Free blocks form chains of up to `kBatchSize`; the head of a chain in a central list
+    // also links to the next chain and remembers the chain length
+    struct FreeBlock {
+        FreeBlock* next;
+        FreeBlock* next_chain;
+        size_t count;
+    };
+
+    // Written only by the owning thread, read by `GetStats`
+    struct ThreadStats {
+        std::atomic<size_t> allocations = 0;
+        std::atomic<size_t> hits = 0;
+        std::atomic<size_t> refills = 0;
+        std::atomic<size_t> slabs = 0;
+        std::atomic<size_t> oversized = 0;
+        std::atomic<size_t> deallocations = 0;
+
+        void AddTo(BlockPoolStats& stats) const {
+            stats.allocations += allocations.load(std::memory_order_relaxed);
+            stats.hits += hits.load(std::memory_order_relaxed);
+            stats.refills += refills.load(std::memory_order_relaxed);
+            stats.slabs += slabs.load(std::memory_order_relaxed);
+            stats.oversized += oversized.load(std::memory_order_relaxed);
+            stats.deallocations += deallocations.load(std::memory_order_relaxed);
+        }
+    };
+
+    struct ThreadCache;
+
+    class Central {
+    public:
+        // nullptr if the list is empty
+        FreeBlock* Pop(size_t size_class) {
+            std::lock_guard<std::mutex> lock(mutexes_[size_class]);
+            FreeBlock* chain = chains_[size_class];
+            if (chain) {
+                chains_[size_class] = chain->next_chain;
+            }
+            return chain;
+        }
+        void Push(size_t size_class, FreeBlock* chain) {
+            std::lock_guard<std::mutex> lock(mutexes_[size_class]);
+            chain->next_chain = chains_[size_class];
+            chains_[size_class] = chain;
+        }
+
+        // Cut a new slab into chains, return one and publish the rest
+        FreeBlock* CarveSlab(size_t size_class) {
+            size_t block_size = (size_class + 1) * kGranularity;
+            size_t blocks = kSlabSize / block_size;
+            auto slab = static_cast<char*>(::operator new(kSlabSize));
+            FreeBlock* first = nullptr;
+            for (size_t begin = 0; begin < blocks; begin += kBatchSize) {
+                size_t end = std::min(blocks, begin + kBatchSize);
+                auto head = reinterpret_cast<FreeBlock*>(slab + begin * block_size);
+                for (size_t i = begin; i < end; ++i) {
+                    auto block = reinterpret_cast<FreeBlock*>(slab + i * block_size);
+                    block->next = (i + 1 < end)
+                                      ? reinterpret_cast<FreeBlock*>(slab + (i + 1) * block_size)
+                                      : nullptr;
+                }
+                head->count = end - begin;
+                if (!first) {
+                    first = head;
+                } else {
+                    Push(size_class, head);
+                }
+            }
+            return first;
+        }
+
+        std::mutex stats_mutex;
+        std::vector<const ThreadCache*> caches;
+        BlockPoolStats retired;
+
+    private:
+        std::mutex mutexes_[kClasses];
+        FreeBlock* chains_[kClasses] = {};
+    };
+
+    struct ThreadCache {
+        ThreadCache() {
+            Central& central = GetCentral();
+            std::lock_guard<std::mutex> lock(central.stats_mutex);
+            central.caches.push_back(this);
+        }
+        ~ThreadCache() {
+            for (size_t size_class = 0; size_class < kClasses; ++size_class) {
+                if (lists[size_class]) {
+                    lists[size_class]->count = counts[size_class];
+                    GetCentral().Push(size_class, lists[size_class]);
+                }
+            }
+            Central& central = GetCentral();
+            std::lock_guard<std::mutex> lock(central.stats_mutex);
+            stats.AddTo(central.retired);
+            central.caches.erase(std::find(central.caches.begin(), central.caches.end(), this));
+        }
+
+        void* Allocate(size_t size_class) {
+            BumpOwned(stats.allocations);
+            FreeBlock* block = lists[size_class];
+            if (block) {
+                BumpOwned(stats.hits);
+            } else {
+                BumpOwned(stats.refills);
+                block = GetCentral().Pop(size_class);
+                if (!block) {
+                    BumpOwned(stats.slabs);
+                    block = GetCentral().CarveSlab(size_class);
+                }
+                counts[size_class] = block->count;
+            }
+            lists[size_class] = block->next;
+            --counts[size_class];
+            return block;
+        }
+
+        void Deallocate(size_t size_class, FreeBlock* block) {
+            BumpOwned(stats.deallocations);
+            block->next = lists[size_class];
+            lists[size_class] = block;
+            if (++counts[size_class] < 2 * kBatchSize) {
+                return;
+            }
+            // Hand the older half back in one piece
+            FreeBlock* last = block;
+            for (size_t i = 1; i < kBatchSize; ++i) {
+                last = last->next;
+            }
+            FreeBlock* rest = last->next;
+            last->next = nullptr;
+            lists[size_class] = block;
+            counts[size_class] = kBatchSize;
+            rest->count = kBatchSize;
+            GetCentral().Push(size_class, rest);
+        }
+
+        FreeBlock* lists[kClasses] = {};
+        size_t counts[kClasses] = {};
+        ThreadStats stats;
+    };
+
+    static size_t SizeClass(size_t size) {
+        return (std::max(size, sizeof(FreeBlock)) - 1) / kGranularity;
+    }
+
+    static Central& GetCentral() {
+        return NeverDestroyed<Central>();
+    }
+    static ThreadCache* GetThreadCache() {
+        return ThreadLocalOrNull<ThreadCache>();
+    }
+};
+
+// Stateless allocator on top of `BlockPool`; requests the pool cannot serve go to the global heap
+template <class T>
+class BlockPoolAllocator {
+public:
+    using value_type = T;
+
+    BlockPoolAllocator() = default;
+    template <class U>
+    BlockPoolAllocator(const BlockPoolAllocator<U>&){};
+
+    T* allocate(size_t n) {
+        if (n == 1 && BlockPool::IsPooled(sizeof(T), alignof(T))) {
+            return static_cast<T*>(BlockPool::Allocate(sizeof(T)));
+        }
+        BlockPool::CountOversized();
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+    void deallocate(T* ptr, size_t n) {
+        if (n == 1 && BlockPool::IsPooled(sizeof(T), alignof(T))) {
+            BlockPool::Deallocate(ptr, sizeof(T));
+            return;
+        }
+        ::operator delete(ptr, std::align_val_t(alignof(T)));
+    }
+
+    template <class U>
+    bool operator==(const BlockPoolAllocator<U>&) const {
+        return true;
+    }
+    template <class U>
+    bool operator!=(const BlockPoolAllocator<U>&) const {
+        return false;
+    }
+};
@@ -0,0 +1,528 @@
+#pragma once
+
+#include "sharded_count.h"
+#include "../unique-ptr/per_thread.h"
+
+#include <atomic>
+#include <cstddef>  // size_t
+#include <cstdint>  // intptr_t, uint64_t
+#include <mutex>
+#include <new>        // std::nothrow
+#include <stdexcept>  // std::overflow_error
+#include <utility>    // std::swap
+#include <vector>
+
+// Counting policies for `ControlBlockBase`.
+// Every policy starts with one strong and one weak reference: the strong owners collectively
+// hold a single weak reference, which they drop together with the object.
+
+// How a counter that cannot tell right away whether a dropped strong reference was the last one
+// gets back to its block, see `BiasedSharedCounter`. Once the count is known, some thread calls
+// `finish(block, left)` with `left` strong references remaining. Meanwhile the counter holds an
+// extra weak reference on the block, which `finish` drops. Other policies ignore it.
+struct DeferredRelease {
+    void* block = nullptr;
+    void (*finish)(void* block, size_t left) = nullptr;
+};
+
+// Plain counters. Cheapest, but a control block must never be touched from two threads.
+class PlainSharedCounter {
+public:
+    void IncStrong() {
+        ++strong_;
+    }
+    size_t DecStrong(DeferredRelease = {}) {
+        return --strong_;
+    }
+    // Increment the strong counter only if the object is still alive.
+    bool TryIncStrong() {
+        if (strong_ == 0) {
+            return false;
+        }
+        ++strong_;
+        return true;
+    }
+    void IncWeak() {
+        ++weak_;
+    }
+    size_t DecWeak() {
+        return --weak_;
+    }
+    size_t UseCount() const {
+        return strong_;
+    }
+    size_t WeakCount() const {
+        return weak_;
+    }
+
+private:
+    size_t strong_ = 1;
+    size_t weak_ = 1;
+};
+
+// Atomic counters.
+// New references are always made from an existing one, so increments need no ordering.
+// Decrements are acq_rel: every access made through other owners happens-before the destruction
+// performed by the owner that dropped the counter to zero.
+class AtomicSharedCounter {
+public:
+    void IncStrong() {
+        strong_.fetch_add(1, std::memory_order_relaxed);
+    }
+    size_t DecStrong(DeferredRelease = {}) {
+        return strong_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    }
+    // Increment the strong counter only if the object is still alive.
+    bool TryIncStrong() {
+        size_t current = strong_.load(std::memory_order_relaxed);
+        while (current != 0) {
+            if (strong_.compare_exchange_weak(current, current + 1, std::memory_order_acquire,
+                                              std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    void IncWeak() {
+        weak_.fetch_add(1, std::memory_order_relaxed);
+    }
+    size_t DecWeak() {
+        return weak_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    }
+    size_t UseCount() const {
+        return strong_.load(std::memory_order_acquire);
+    }
+    size_t WeakCount() const {
+        return weak_.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<size_t> strong_ = 1;
+    std::atomic<size_t> weak_ = 1;
+};
+
+// Atomic counters packed into one 64-bit word: strong count in the low half, weak in the high
+// half. Saves 8 bytes per block, and lets the sole owner of a block release it without any
+// read-modify-write: one load shows that nobody else holds a strong or weak reference.
+class PackedSharedCounter {
+public:
+    void IncStrong() {
+        uint64_t old = word_.fetch_add(kStrongOne, std::memory_order_relaxed);
+        if ((old & kStrongMask) == kStrongMask) {
+            // Readers may briefly see a zero strong count, which only makes `TryIncStrong` fail
+            word_.fetch_sub(kStrongOne, std::memory_order_relaxed);
+            throw std::overflow_error("too many SharedPtr owners");
+        }
+    }
+    size_t DecStrong(DeferredRelease = {}) {
+        if (word_.load(std::memory_order_acquire) == (kStrongOne | kWeakOne)) {
+            return 0;
+        }
+        return ((word_.fetch_sub(kStrongOne, std::memory_order_acq_rel) - 1) & kStrongMask);
+    }
+    // Increment the strong counter only if the object is still alive. A saturated counter
+    // fails too, so `WeakPtr::Lock` never throws.
+    bool TryIncStrong() {
+        uint64_t current = word_.load(std::memory_order_relaxed);
+        while ((current & kStrongMask) != 0) {
+            if ((current & kStrongMask) == kStrongMask) {
+                return false;
+            }
+            if (word_.compare_exchange_weak(current, current + kStrongOne,
+                                            std::memory_order_acquire,
+                                            std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    void IncWeak() {
+        uint64_t old = word_.fetch_add(kWeakOne, std::memory_order_relaxed);
+        if ((old >> kWeakShift) == kStrongMask) {
+            word_.fetch_sub(kWeakOne, std::memory_order_relaxed);
+            throw std::overflow_error("too many WeakPtr owners");
+        }
+    }
+    // A weak count of one is the caller's own reference, and nobody can take a new one
+    size_t DecWeak() {
+        if ((word_.load(std::memory_order_acquire) >> kWeakShift) == 1) {
+            return 0;
+        }
+        return (word_.fetch_sub(kWeakOne, std::memory_order_acq_rel) >> kWeakShift) - 1;
+    }
+    size_t UseCount() const {
+        return word_.load(std::memory_order_acquire) & kStrongMask;
+    }
+    size_t WeakCount() const {
+        return word_.load(std::memory_order_acquire) >> kWeakShift;
+    }
+
+private:
+    static constexpr int kWeakShift = 32;
+    static constexpr uint64_t kStrongMask = (uint64_t(1) << kWeakShift) - 1;
+    static constexpr uint64_t kStrongOne = 1;
+    static constexpr uint64_t kWeakOne = uint64_t(1) << kWeakShift;
+
+    std::atomic<uint64_t> word_ = kStrongOne | kWeakOne;
+};
+
+class BiasedSharedCounter;
+
+// Per-thread record for biased reference counting.
+// Non-owner threads queue blocks here when their owner has to fold the biased counter into
+// the shared one. Records are recycled, never freed, so a stale pointer is always safe to lock.
+class BiasedOwner {
+public:
+    // nullptr while the calling thread destroys its thread-locals, or on every call if its
+    // record could not be allocated; such a thread only uses the shared counters. Never throws,
+    // so that `WeakPtr::Lock` does not either.
+    static BiasedOwner* Current() {
+        Slot* slot = ThreadLocalOrNull<Slot>();
+        return slot ? slot->owner : nullptr;
+    }
+
+    // `Current()` after merging the blocks other threads queued for it, which may destroy their
+    // objects. Biased counters poll only when the thread drops a strong reference, never when it
+    // makes or copies one, so those never run unrelated destructors. A thread that only creates
+    // blocks and hands them away should call this now and then, or the blocks it owns stay
+    // allocated until it exits.
+    static BiasedOwner* Poll() {
+        BiasedOwner* me = Current();
+        if (me && me->HasPending()) {
+            me->MergePending();
+        }
+        return me;
+    }
+
+    bool HasPending() const {
+        return pending_.load(std::memory_order_relaxed);
+    }
+    // Owner thread only
+    void MergePending();
+
+private:
+    friend class BiasedSharedCounter;
+
+    struct Pending {
+        BiasedSharedCounter* counter;
+        DeferredRelease release;
+    };
+
+    // The calling thread's record, given back when the thread exits
+    struct Slot {
+        BiasedOwner* owner = Adopt();
+        ~Slot() {
+            if (owner) {
+                owner->Retire();
+            }
+        }
+    };
+
+    static BiasedOwner* Adopt() {
+        BiasedOwner* owner = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(FreeListMutex());
+            if (!FreeList().empty()) {
+                owner = FreeList().back();
+                FreeList().pop_back();
+            }
+        }
+        if (!owner) {
+            owner = new (std::nothrow) BiasedOwner;
+            if (!owner) {
+                return nullptr;
+            }
+        }
+        std::lock_guard<std::mutex> lock(owner->mutex_);
+        owner->alive_ = true;
+        return owner;
+    }
+
+    // From now on non-owner threads merge this owner's blocks themselves
+    void Retire() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (queue_.empty()) {
+                    alive_ = false;
+                    break;
+                }
+            }
+            MergePending();
+        }
+        std::lock_guard<std::mutex> lock(FreeListMutex());
+        FreeList().push_back(this);
+    }
+
+    static std::mutex& FreeListMutex() {
+        return NeverDestroyed<std::mutex, BiasedOwner>();
+    }
+    static std::vector<BiasedOwner*>& FreeList() {
+        return NeverDestroyed<std::vector<BiasedOwner*>, BiasedOwner>();
+    }
+
+    std::mutex mutex_;
+    std::vector<Pending> queue_;
+    std::atomic<bool> pending_ = false;
+    bool alive_ = false;
+};
+
+// Biased counters: the thread that created the block updates its own strong counter with plain
+// loads and stores, every other thread uses the shared atomic one. When the owner drops its last
+// reference the two are merged and the block behaves like `AtomicSharedCounter` from then on.
+// If other threads drop more references than they took before that, the block is handed to the
+// owner to merge (see `HandOff`). Weak references are always atomic.
+class BiasedSharedCounter {
+public:
+    BiasedSharedCounter() {
+        BiasedOwner* owner = BiasedOwner::Current();
+        if (owner) {
+            owner_.store(owner, std::memory_order_relaxed);
+            biased_.store(1, std::memory_order_relaxed);
+        } else {
+            shared_.store(kOne | kMerged, std::memory_order_relaxed);
+        }
+    }
+
+    void IncStrong() {
+        BiasedOwner* me = BiasedOwner::Current();
+        if (me && owner_.load(std::memory_order_relaxed) == me) {
+            biased_.store(biased_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        } else {
+            shared_.fetch_add(kOne, std::memory_order_relaxed);
+        }
+    }
+    // 0 if the object has to be destroyed. If only the owner thread can tell, the block goes to
+    // `release` later instead and this returns non-zero.
+    size_t DecStrong(DeferredRelease release) {
+        BiasedOwner* me = BiasedOwner::Poll();
+        if (me && owner_.load(std::memory_order_relaxed) == me) {
+            intptr_t biased = biased_.load(std::memory_order_relaxed) - 1;
+            biased_.store(biased, std::memory_order_relaxed);
+            if (biased != 0) {
+                return kNotLast;
+            }
+            return Merge();
+        }
+        // The decrement that takes the shared count below zero also marks the block queued, so
+        // from then on only this thread's hand-off merges it and nobody frees it under us. The
+        // hand-off's weak reference is taken while this thread still holds a strong one.
+        intptr_t old = shared_.load(std::memory_order_relaxed);
+        bool guarded = false;
+        while (true) {
+            bool hand_off = !(old & (kMerged | kQueued)) && (old >> kShift) <= 0;
+            if (hand_off && !guarded) {
+                IncWeak();
+            } else if (!hand_off && guarded) {
+                DecWeak();
+            }
+            guarded = hand_off;
+            intptr_t next = (old - kOne) | (hand_off ? kQueued : 0);
+            if (shared_.compare_exchange_weak(old, next, std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        if (old & kMerged) {
+            return (old >> kShift) - 1;
+        }
+        if (guarded) {
+            HandOff(release);
+        }
+        return kNotLast;
+    }
+    // Fold the biased counter into the shared one, returns the strong count after that
+    // (`kNotLast` if it is merged already). A block another thread queued is left to the
+    // `queued` merge of `MergePending` or of that thread. Owner thread or a thread holding the
+    // lock of a dead owner only.
+    size_t Merge(bool queued = false) {
+        intptr_t biased = biased_.load(std::memory_order_relaxed);
+        intptr_t old = shared_.load(std::memory_order_relaxed);
+        do {
+            if ((old & kMerged) || ((old & kQueued) && !queued)) {
+                return kNotLast;
+            }
+        } while (!shared_.compare_exchange_weak(old, old + biased * kOne + kMerged,
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_relaxed));
+        biased_.store(0, std::memory_order_relaxed);
+        owner_.store(nullptr, std::memory_order_relaxed);
+        return (old >> kShift) + biased;
+    }
+    // Increment the strong counter only if the object is still alive.
+    bool TryIncStrong() {
+        if (IsOwner()) {
+            intptr_t biased = biased_.load(std::memory_order_relaxed);
+            if (biased + (shared_.load(std::memory_order_acquire) >> kShift) <= 0) {
+                return false;
+            }
+            biased_.store(biased + 1, std::memory_order_relaxed);
+            return true;
+        }
+        intptr_t current = shared_.load(std::memory_order_relaxed);
+        while (true) {
+            intptr_t alive = current >> kShift;
+            if (!(current & kMerged)) {
+                alive += biased_.load(std::memory_order_relaxed);
+            }
+            if (alive <= 0) {
+                return false;
+            }
+            if (shared_.compare_exchange_weak(current, current + kOne, std::memory_order_acquire,
+                                              std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+    void IncWeak() {
+        weak_.fetch_add(1, std::memory_order_relaxed);
+    }
+    size_t DecWeak() {
+        return weak_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    }
+    size_t UseCount() const {
+        intptr_t count = biased_.load(std::memory_order_relaxed) +
+                         (shared_.load(std::memory_order_acquire) >> kShift);
+        return count > 0 ? count : 0;
+    }
+    size_t WeakCount() const {
+        return weak_.load(std::memory_order_acquire);
+    }
+
+private:
+    // `shared_` keeps the count above two flag bits
+    static constexpr intptr_t kMerged = 1;
+    static constexpr intptr_t kQueued = 2;
+    static constexpr int kShift = 2;
+    static constexpr intptr_t kOne = intptr_t(1) << kShift;
+    static constexpr size_t kNotLast = 1;
+
+    // Once per block, by the thread whose decrement queued it, holding the extra weak reference
+    // that decrement took. If the owner is still running, queues the block for it. Otherwise
+    // merges right away and finishes the release here, outside the owner's lock.
+    void HandOff(const DeferredRelease& release) {
+        BiasedOwner* owner = owner_.load(std::memory_order_relaxed);
+        size_t left;
+        {
+            std::lock_guard<std::mutex> lock(owner->mutex_);
+            if (owner->alive_) {
+                owner->queue_.push_back({this, release});
+                owner->pending_.store(true, std::memory_order_relaxed);
+                return;
+            }
+            left = Merge(true);
+        }
+        release.finish(release.block, left);
+    }
+    bool IsOwner() const {
+        BiasedOwner* owner = owner_.load(std::memory_order_relaxed);
+        return owner && owner == BiasedOwner::Current();
+    }
+
+    std::atomic<BiasedOwner*> owner_ = nullptr;
+    std::atomic<intptr_t> biased_ = 0;
+    std::atomic<intptr_t> shared_ = 0;
+    std::atomic<size_t> weak_ = 1;
+};
+
+inline void BiasedOwner::MergePending() {
+    std::vector<Pending> queue;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::swap(queue, queue_);
+        pending_.store(false, std::memory_order_relaxed);
+    }
+    for (const Pending& pending : queue) {
+        pending.release.finish(pending.release.block, pending.counter->Merge(true));
+    }
+}
+
+// Strong count alone, for control blocks that never have weak references
+class PlainStrongCounter {
+public:
+    void IncStrong() {
+        ++strong_;
+    }
+    size_t DecStrong() {
+        return --strong_;
+    }
+    size_t UseCount() const {
+        return strong_;
+    }
+
+private:
+    size_t strong_ = 1;
+};
+
+class AtomicStrongCounter {
+public:
+    void IncStrong() {
+        strong_.fetch_add(1, std::memory_order_relaxed);
+    }
+    size_t DecStrong() {
+        return strong_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    }
+    size_t UseCount() const {
+        return strong_.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<size_t> strong_ = 1;
+};
+
+// `ShardedCount` for the strong references, a plain atomic for the weak ones.
+// Not a build-wide choice; blocks of types marked with `ShardedRefCount` use it.
+class ShardedSharedCounter {
+public:
+    void IncStrong() {
+        strong_.Inc();
+    }
+    size_t DecStrong(DeferredRelease = {}) {
+        return strong_.Dec();
+    }
+    bool TryIncStrong() {
+        return strong_.TryInc();
+    }
+    size_t SwitchToAtomic() {
+        return strong_.SwitchToAtomic();
+    }
+    void IncWeak() {
+        weak_.fetch_add(1, std::memory_order_relaxed);
+    }
+    size_t DecWeak() {
+        return weak_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    }
+    size_t UseCount() const {
+        return strong_.Count();
+    }
+    size_t WeakCount() const {
+        return weak_.load(std::memory_order_acquire);
+    }
+
+private:
+    ShardedCount strong_{1};
+    std::atomic<size_t> weak_ = 1;
+};
+
+// Build-wide choice. Define SMART_PTRS_SINGLE_THREADED to drop the atomics,
+// SMART_PTRS_BIASED_COUNTERS to make the creating thread's updates non-atomic, or
+// SMART_PTRS_PACKED_COUNTERS for 16-byte control block headers.
+#if defined(SMART_PTRS_SINGLE_THREADED) + defined(SMART_PTRS_BIASED_COUNTERS) + \
+        defined(SMART_PTRS_PACKED_COUNTERS) > 1
+#error "Pick one of SMART_PTRS_SINGLE_THREADED, _BIASED_COUNTERS and _PACKED_COUNTERS"
+#elif defined(SMART_PTRS_SINGLE_THREADED)
+using SharedCounter = PlainSharedCounter;
+#elif defined(SMART_PTRS_BIASED_COUNTERS)
+using SharedCounter = BiasedSharedCounter;
+#elif defined(SMART_PTRS_PACKED_COUNTERS)
+using SharedCounter = PackedSharedCounter;
+#else
+using SharedCounter = AtomicSharedCounter;
+#endif
+
+// Biased and packed builds keep strong-only blocks on the plain atomic counter
+#ifdef SMART_PTRS_SINGLE_THREADED
+using StrongCounter = PlainStrongCounter;
+#else
+using StrongCounter = AtomicStrongCounter;
+#endif
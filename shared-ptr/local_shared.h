@@ -0,0 +1,402 @@
+#pragma once
+
+#include "sw_fwd.h"  // BadWeakPtr
+#include "../unique-ptr/compressed_pair.h"
+#include "../unique-ptr/unique.h"
+
+#include <cassert>
+#include <cstddef>  // std::nullptr_t
+#include <cstdint>  // uint32_t, UINT32_MAX
+#include <new>
+#include <stdexcept>  // std::overflow_error
+#include <thread>
+#include <type_traits>
+
+// `SharedPtr` for objects that never leave their thread, whatever counter policy the build uses.
+// Counters are plain 32-bit integers, and instead of virtual functions the block keeps one
+// function that either destroys the object or frees the block, so a block adds 16 bytes.
+// Debug builds check that every copy and release happens on the creating thread.
+
+template <typename T>
+class LocalSharedPtr;
+
+template <typename T>
+class LocalWeakPtr;
+
+class LocalControlBlock {
+public:
+    enum class Op { kDestroyObject, kFreeBlock };
+    using Manager = void (*)(LocalControlBlock*, Op);
+
+    explicit LocalControlBlock(Manager manager) : manager_(manager){};
+
+    // Like `PackedSharedCounter`, throws instead of wrapping a 32-bit count
+    void IncCounter(bool is_weak = false) {
+        CheckThread();
+        if (is_weak) {
+            if (weak_ == UINT32_MAX) {
+                throw std::overflow_error("too many LocalWeakPtr owners");
+            }
+            ++weak_;
+        } else {
+            if (strong_ == UINT32_MAX) {
+                throw std::overflow_error("too many LocalSharedPtr owners");
+            }
+            ++strong_;
+        }
+    }
+    // A saturated counter fails too, so `LocalWeakPtr::Lock` never throws
+    bool TryIncCounter() {
+        CheckThread();
+        if (strong_ == 0 || strong_ == UINT32_MAX) {
+            return false;
+        }
+        ++strong_;
+        return true;
+    }
+    void DecCounter(bool is_weak = false) {
+        CheckThread();
+        if (!is_weak) {
+            if (--strong_ != 0) {
+                return;
+            }
+            manager_(this, Op::kDestroyObject);
+        }
+        if (--weak_ == 0) {
+            manager_(this, Op::kFreeBlock);
+        }
+    }
+    size_t GetCounter(bool is_weak = false) const {
+        return is_weak ? weak_ : strong_;
+    }
+
+private:
+    void CheckThread() const {
+#ifndef NDEBUG
+        assert(owner_ == std::this_thread::get_id() && "LocalSharedPtr used from another thread");
+#endif
+    }
+
+    uint32_t strong_ = 1;
+    uint32_t weak_ = 1;
+    Manager manager_;
+#ifndef NDEBUG
+    std::thread::id owner_ = std::this_thread::get_id();
+#endif
+};
+
+// Block for a pointer adopted by `LocalSharedPtr`, with the deleter stored as in `ControlBlockPtr`
+template <class T, class Deleter = Slug<T>>
+class LocalControlBlockPtr : public LocalControlBlock {
+public:
+    LocalControlBlockPtr(T* pointer, Deleter deleter)
+        : LocalControlBlock(&Manage), data_(pointer, std::move(deleter)){};
+
+private:
+    static void Manage(LocalControlBlock* base, Op op) {
+        auto block = static_cast<LocalControlBlockPtr*>(base);
+        if (op == Op::kDestroyObject) {
+            block->data_.GetSecond()(block->data_.GetFirst());
+            block->data_.GetFirst() = nullptr;
+        } else {
+            delete block;
+        }
+    }
+
+    CompressedPair<T*, Deleter> data_;
+};
+
+template <class T>
+class LocalControlBlockBuffer : public LocalControlBlock {
+public:
+    template <typename... Args>
+    LocalControlBlockBuffer(Args&&... args) : LocalControlBlock(&Manage) {
+        new (&data_) T(std::forward<Args>(args)...);
+    }
+    T* GetObserved() {
+        return reinterpret_cast<T*>(&data_);
+    }
+
+private:
+    static void Manage(LocalControlBlock* base, Op op) {
+        auto block = static_cast<LocalControlBlockBuffer*>(base);
+        if (op == Op::kDestroyObject) {
+            block->GetObserved()->~T();
+        } else {
+            delete block;
+        }
+    }
+
+    std::aligned_storage_t<sizeof(T), alignof(T)> data_;
+};
+
+template <typename T>
+class LocalSharedPtr {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    LocalSharedPtr() : block_(nullptr), observed_(nullptr){};
+    LocalSharedPtr(std::nullptr_t) : block_(nullptr), observed_(nullptr){};
+    // `ptr` is deleted if the control block cannot be allocated
+    template <class U>
+    explicit LocalSharedPtr(U* ptr) : LocalSharedPtr(ptr, Slug<U>()){};
+    // `deleter(ptr)` runs instead of `delete` when the last owner goes away, or right away if
+    // the control block cannot be allocated
+    template <class U, class Deleter>
+    LocalSharedPtr(U* ptr, Deleter deleter) : block_(nullptr), observed_(ptr) {
+        try {
+            block_ = new LocalControlBlockPtr<U, Deleter>(ptr, std::move(deleter));
+        } catch (...) {
+            deleter(ptr);
+            throw;
+        }
+    };
+    LocalSharedPtr(const LocalSharedPtr& other) {
+        block_ = other.block_;
+        observed_ = other.observed_;
+        if (block_) {
+            block_->IncCounter();
+        }
+    }
+    LocalSharedPtr(LocalSharedPtr&& other) noexcept {
+        block_ = other.block_;
+        observed_ = other.observed_;
+        other.block_ = nullptr;
+        other.observed_ = nullptr;
+    }
+    template <class U>
+    LocalSharedPtr(const LocalSharedPtr<U>& other) {
+        block_ = other.block_;
+        observed_ = other.observed_;
+        if (block_) {
+            block_->IncCounter();
+        }
+    }
+    template <class U>
+    LocalSharedPtr(LocalSharedPtr<U>&& other) noexcept {
+        block_ = other.block_;
+        observed_ = other.observed_;
+        other.block_ = nullptr;
+        other.observed_ = nullptr;
+    }
+
+    // Aliasing constructor
+    template <typename Y>
+    LocalSharedPtr(const LocalSharedPtr<Y>& other, T* ptr) {
+        block_ = other.block_;
+        observed_ = ptr;
+        if (block_) {
+            block_->IncCounter();
+        }
+    }
+
+    // Promote `LocalWeakPtr`
+    explicit LocalSharedPtr(const LocalWeakPtr<T>& other) {
+        if (!other.block_ || !other.block_->TryIncCounter()) {
+            throw BadWeakPtr();
+        }
+        block_ = other.block_;
+        observed_ = other.observed_;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    LocalSharedPtr& operator=(const LocalSharedPtr& other) {
+        LocalSharedPtr(other).Swap(*this);
+        return *this;
+    }
+    LocalSharedPtr& operator=(LocalSharedPtr&& other) noexcept {
+        LocalSharedPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+    template <class U>
+    LocalSharedPtr& operator=(const LocalSharedPtr<U>& other) {
+        LocalSharedPtr(other).Swap(*this);
+        return *this;
+    }
+    template <class U>
+    LocalSharedPtr& operator=(LocalSharedPtr<U>&& other) noexcept {
+        LocalSharedPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~LocalSharedPtr() {
+        if (block_) {
+            block_->DecCounter();
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset() {
+        LocalSharedPtr().Swap(*this);
+    }
+    template <class U>
+    void Reset(U* ptr) {
+        LocalSharedPtr(ptr).Swap(*this);
+    }
+    template <class U, class Deleter>
+    void Reset(U* ptr, Deleter deleter) {
+        LocalSharedPtr(ptr, std::move(deleter)).Swap(*this);
+    }
+    void Swap(LocalSharedPtr& other) {
+        std::swap(block_, other.block_);
+        std::swap(observed_, other.observed_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const {
+        return observed_;
+    }
+    std::add_lvalue_reference_t<T> operator*() const {
+        return *observed_;
+    }
+    T* operator->() const {
+        return observed_;
+    }
+    size_t UseCount() const {
+        if (block_) {
+            return block_->GetCounter();
+        }
+        return 0;
+    }
+    explicit operator bool() const {
+        return observed_ != nullptr;
+    }
+
+    template <typename U, typename... Args>
+    friend LocalSharedPtr<U> MakeLocalShared(Args&&... args);
+    template <typename S, typename U>
+    friend bool operator==(const LocalSharedPtr<S>& left, const LocalSharedPtr<U>& right);
+
+private:
+    template <class U>
+    friend class LocalSharedPtr;
+    template <class U>
+    friend class LocalWeakPtr;
+    LocalControlBlock* block_;
+    T* observed_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const LocalSharedPtr<T>& left, const LocalSharedPtr<U>& right) {
+    return (left.block_ == right.block_);
+}
+
+// Allocate memory only once
+template <typename T, typename... Args>
+LocalSharedPtr<T> MakeLocalShared(Args&&... args) {
+    LocalSharedPtr<T> ans;
+    auto new_block = new LocalControlBlockBuffer<T>(std::forward<Args>(args)...);
+    ans.block_ = new_block;
+    ans.observed_ = new_block->GetObserved();
+    return ans;
+}
+
+template <typename T>
+class LocalWeakPtr {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    LocalWeakPtr() : block_(nullptr), observed_(nullptr){};
+    LocalWeakPtr(const LocalWeakPtr& other) {
+        block_ = other.block_;
+        observed_ = other.observed_;
+        if (block_) {
+            block_->IncCounter(true);
+        }
+    }
+    LocalWeakPtr(LocalWeakPtr&& other) noexcept {
+        block_ = other.block_;
+        observed_ = other.observed_;
+        other.block_ = nullptr;
+        other.observed_ = nullptr;
+    }
+    template <class U>
+    LocalWeakPtr(const LocalWeakPtr<U>& other) {
+        block_ = other.block_;
+        observed_ = other.observed_;
+        if (block_) {
+            block_->IncCounter(true);
+        }
+    }
+    // Demote `LocalSharedPtr`
+    template <class U>
+    LocalWeakPtr(const LocalSharedPtr<U>& other) {
+        block_ = other.block_;
+        observed_ = other.observed_;
+        if (block_) {
+            block_->IncCounter(true);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    LocalWeakPtr& operator=(const LocalWeakPtr& other) {
+        LocalWeakPtr(other).Swap(*this);
+        return *this;
+    }
+    LocalWeakPtr& operator=(LocalWeakPtr&& other) noexcept {
+        LocalWeakPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~LocalWeakPtr() {
+        if (block_) {
+            block_->DecCounter(true);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset() {
+        LocalWeakPtr().Swap(*this);
+    }
+    void Swap(LocalWeakPtr& other) {
+        std::swap(block_, other.block_);
+        std::swap(observed_, other.observed_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t UseCount() const {
+        if (block_) {
+            return block_->GetCounter();
+        }
+        return 0;
+    }
+    bool Expired() const {
+        return (UseCount() == 0);
+    }
+    LocalSharedPtr<T> Lock() const {
+        LocalSharedPtr<T> ans;
+        if (block_ && block_->TryIncCounter()) {
+            ans.block_ = block_;
+            ans.observed_ = observed_;
+        }
+        return ans;
+    }
+
+private:
+    template <class U>
+    friend class LocalSharedPtr;
+    template <class U>
+    friend class LocalWeakPtr;
+    LocalControlBlock* block_;
+    T* observed_;
+};
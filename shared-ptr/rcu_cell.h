@@ -0,0 +1,260 @@
+#pragma once
+
+#include "shared.h"
+#include "../unique-ptr/per_thread.h"
+
+#include <atomic>
+#include <cstdint>  // uint64_t, UINT64_MAX
+#include <mutex>
+#include <thread>   // std::this_thread::yield
+#include <utility>  // std::move
+#include <vector>
+
+// Epochs shared by every `RcuCell`.
+// A reader publishes the global epoch in its thread's record while it reads, and a writer that
+// unlinked a version in epoch `e` frees it once no reader is left in an epoch before `e`.
+// Readers write only their own record, so reads never bounce a cache line between cores.
+class RcuEpochs {
+public:
+    static constexpr uint64_t kQuiet = 0;
+
+    // One per thread, each on its own cache line. Records of finished threads are reused, never
+    // freed, so writers can walk the list without locking.
+    struct alignas(64) Record {
+        std::atomic<uint64_t> epoch = kQuiet;
+        std::atomic<bool> in_use = true;
+        size_t depth = 0;  // nested readers, touched by the owner thread only
+        Record* next = nullptr;
+    };
+
+    // nullptr while the calling thread destroys its thread-locals
+    static Record* Current() {
+        Slot* slot = ThreadLocalOrNull<Slot>();
+        return slot ? slot->record : nullptr;
+    }
+
+    // The store has to be visible before the reader loads the version, hence seq_cst here and in
+    // `RcuCell`: it pairs with the writer publishing the version before it reads the records.
+    // Acquiring the epoch makes a reader that sees an advanced epoch also see the new version.
+    static void Enter(Record* record) {
+        if (record->depth++ == 0) {
+            record->epoch.store(GlobalEpoch().load(std::memory_order_acquire),
+                                std::memory_order_seq_cst);
+        }
+    }
+    static void Leave(Record* record) {
+        if (--record->depth == 0) {
+            record->epoch.store(kQuiet, std::memory_order_release);
+        }
+    }
+
+    // Call after unlinking a version; it can be freed once `Oldest()` reaches the result
+    static uint64_t Advance() {
+        return GlobalEpoch().fetch_add(1, std::memory_order_seq_cst) + 1;
+    }
+    // Epoch of the oldest reader still reading, UINT64_MAX if there is none
+    static uint64_t Oldest() {
+        uint64_t oldest = UINT64_MAX;
+        for (Record* record = Head().load(std::memory_order_acquire); record;
+             record = record->next) {
+            uint64_t epoch = record->epoch.load(std::memory_order_seq_cst);
+            if (epoch != kQuiet && epoch < oldest) {
+                oldest = epoch;
+            }
+        }
+        return oldest;
+    }
+
+private:
+    // The calling thread's record, given back when the thread exits
+    struct Slot {
+        Record* record = Adopt();
+        ~Slot() {
+            record->in_use.store(false, std::memory_order_release);
+        }
+    };
+
+    static Record* Adopt() {
+        for (Record* record = Head().load(std::memory_order_acquire); record;
+             record = record->next) {
+            bool in_use = false;
+            if (!record->in_use.load(std::memory_order_relaxed) &&
+                record->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire)) {
+                return record;
+            }
+        }
+        auto record = new Record;
+        record->next = Head().load(std::memory_order_relaxed);
+        while (!Head().compare_exchange_weak(record->next, record, std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+        }
+        return record;
+    }
+
+    static std::atomic<Record*>& Head() {
+        static std::atomic<Record*> head = nullptr;
+        return head;
+    }
+    static std::atomic<uint64_t>& GlobalEpoch() {
+        static std::atomic<uint64_t> epoch = 1;
+        return epoch;
+    }
+};
+
+// Read-mostly value, such as a configuration table, behind `SharedPtr<const T>`.
+// `Read` is wait-free and, unlike `AtomicSharedPtr::Load`, never touches the control block of
+// the version it returns. Writers copy the current version, change the copy and publish it;
+// the old version is dropped after every reader that could have seen it has finished.
+// A thread must not update or destroy a cell while it holds a `ReadGuard` of any cell, and
+// `Synchronize` or the destructor wait for readers on other threads.
+template <typename T>
+class RcuCell {
+public:
+    // Pins the version that was current when it was made, later updates do not change it.
+    // Stays on the thread that made it.
+    class ReadGuard {
+    public:
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        ~ReadGuard() {
+            if (record_) {
+                RcuEpochs::Leave(record_);
+            }
+        }
+
+        const T* Get() const {
+            return object_;
+        }
+        const T& operator*() const {
+            return *object_;
+        }
+        const T* operator->() const {
+            return object_;
+        }
+
+    private:
+        friend class RcuCell;
+
+        explicit ReadGuard(const RcuCell& cell) : record_(RcuEpochs::Current()) {
+            if (record_) {
+                RcuEpochs::Enter(record_);
+                object_ = cell.current_.load(std::memory_order_seq_cst)->value.Get();
+            } else {
+                // Thread-locals are gone, take a reference instead
+                pinned_ = cell.LoadLocked();
+                object_ = pinned_.Get();
+            }
+        }
+
+        RcuEpochs::Record* record_;
+        const T* object_;
+        SharedPtr<const T> pinned_;
+    };
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    // The first version is built from `args`
+    template <typename... Args>
+    explicit RcuCell(Args&&... args)
+        : current_(new Version{MakeShared<T>(std::forward<Args>(args)...)}){};
+    RcuCell(const RcuCell&) = delete;
+    RcuCell& operator=(const RcuCell&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~RcuCell() {
+        Synchronize();
+        delete current_.load(std::memory_order_relaxed);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Readers
+
+    ReadGuard Read() const {
+        return ReadGuard(*this);
+    }
+    // An owning copy for keeping past the read, at the cost of one reference count
+    SharedPtr<const T> Load() const {
+        RcuEpochs::Record* record = RcuEpochs::Current();
+        if (!record) {
+            return LoadLocked();
+        }
+        RcuEpochs::Enter(record);
+        SharedPtr<const T> ans = current_.load(std::memory_order_seq_cst)->value;
+        RcuEpochs::Leave(record);
+        return ans;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Writers
+
+    // `fn(T&)` edits a copy of the current version, which is then published. Writers are
+    // serialized, so no update is lost.
+    template <class Fn>
+    void Update(Fn fn) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SharedPtr<T> next = MakeShared<T>(*current_.load(std::memory_order_relaxed)->value);
+        fn(*next);
+        Publish(std::move(next));
+    }
+    void Store(SharedPtr<const T> value) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Publish(std::move(value));
+    }
+
+    // Drop every replaced version, waiting for the readers that may still see them
+    void Synchronize() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (Collect() != 0) {
+            std::this_thread::yield();
+        }
+    }
+    // Replaced versions that still wait for readers
+    size_t Retired() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return retired_.size();
+    }
+
+private:
+    struct Version {
+        SharedPtr<const T> value;
+    };
+
+    struct Retiree {
+        uint64_t epoch;
+        Version* version;
+    };
+
+    void Publish(SharedPtr<const T> value) {
+        Version* old = current_.exchange(new Version{std::move(value)}, std::memory_order_seq_cst);
+        retired_.push_back({RcuEpochs::Advance(), old});
+        Collect();
+    }
+    // Frees what no reader can see any more, returns how many are left
+    size_t Collect() {
+        if (retired_.empty()) {
+            return 0;
+        }
+        uint64_t oldest = RcuEpochs::Oldest();
+        size_t kept = 0;
+        for (Retiree& retiree : retired_) {
+            if (retiree.epoch <= oldest) {
+                delete retiree.version;
+            } else {
+                retired_[kept++] = retiree;
+            }
+        }
+        retired_.resize(kept);
+        return kept;
+    }
+    SharedPtr<const T> LoadLocked() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return current_.load(std::memory_order_relaxed)->value;
+    }
+
+    std::atomic<Version*> current_;
+    mutable std::mutex mutex_;
+    std::vector<Retiree> retired_;
+};
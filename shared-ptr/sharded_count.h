@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>  // size_t
+#include <cstdint>  // intptr_t, INTPTR_MIN
+
+// Strong count spread over per-thread slots, after Linux `percpu_ref`. Every slot has a cache
+// line of its own, so threads copying and dropping references to one hot object do not fight
+// over a line, but nobody knows the total and it cannot be seen reaching zero. `SwitchToAtomic`
+// folds the slots into one atomic count when the object is being torn down, and from then on it
+// counts like a single atomic.
+// Folding marks each slot dead, and an update that finds its slot dead goes to the atomic count
+// instead. Until every slot has been folded the atomic count carries a bias that keeps it off
+// zero. Takes `kSlots` cache lines, so only worth it for a few very hot objects.
+class ShardedCount {
+public:
+    static constexpr size_t kSlots = 16;
+    static constexpr size_t kNotLast = 1;
+
+    explicit ShardedCount(intptr_t initial) : central_(kBias + initial){};
+
+    void Inc() {
+        if (IsDead(GetSlot().fetch_add(1, std::memory_order_relaxed))) {
+            central_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    // The count left, or `kNotLast` before the switch
+    size_t Dec() {
+        if (!IsDead(GetSlot().fetch_sub(1, std::memory_order_release))) {
+            return kNotLast;
+        }
+        return central_.fetch_sub(1, std::memory_order_acq_rel) - 1;
+    }
+    // Nothing dies before the switch, so only a dead slot has to check for zero
+    bool TryInc() {
+        if (!IsDead(GetSlot().fetch_add(1, std::memory_order_relaxed))) {
+            return true;
+        }
+        intptr_t current = central_.load(std::memory_order_relaxed);
+        while (current > 0) {
+            if (central_.compare_exchange_weak(current, current + 1, std::memory_order_acquire,
+                                               std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    // The count left if this call made the switch, `kNotLast` if somebody else already did
+    size_t SwitchToAtomic() {
+        if (switched_.exchange(true, std::memory_order_relaxed)) {
+            return kNotLast;
+        }
+        for (Slot& slot : slots_) {
+            intptr_t count = slot.count.exchange(kDead, std::memory_order_acq_rel);
+            central_.fetch_add(count, std::memory_order_acq_rel);
+        }
+        return central_.fetch_sub(kBias, std::memory_order_acq_rel) - kBias;
+    }
+    // A sum of slots that keep changing, exact only after the switch
+    size_t Count() const {
+        intptr_t total = central_.load(std::memory_order_acquire);
+        for (const Slot& slot : slots_) {
+            intptr_t count = slot.count.load(std::memory_order_relaxed);
+            if (!IsDead(count)) {
+                total += count;
+            }
+        }
+        if (total >= kBias / 2) {
+            total -= kBias;
+        }
+        return total > 0 ? total : 0;
+    }
+
+private:
+    // Live slots never get anywhere near either value
+    static constexpr intptr_t kBias = intptr_t(1) << 40;
+    static constexpr intptr_t kDead = INTPTR_MIN / 2;
+
+    struct alignas(64) Slot {
+        std::atomic<intptr_t> count = 0;
+    };
+
+    static bool IsDead(intptr_t count) {
+        return count < kDead / 2;
+    }
+    // Threads take slots round-robin, and share them past `kSlots`
+    std::atomic<intptr_t>& GetSlot() {
+        static std::atomic<size_t> next = 0;
+        thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % kSlots;
+        return slots_[index].count;
+    }
+
+    Slot slots_[kSlots];
+    std::atomic<intptr_t> central_;
+    std::atomic<bool> switched_ = false;
+};
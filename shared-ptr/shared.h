@@ -1,103 +1,616 @@
 #pragma once
 
 #include "sw_fwd.h"  // Forward declaration
-#include <cstddef>   // std::nullptr_t
+#include "counters.h"
+#include "block_pool.h"
+#include "../unique-ptr/compressed_pair.h"
+#include "../unique-ptr/instrument.h"
+#include "../unique-ptr/unique.h"
+
+#include <algorithm>  // std::max
+#include <atomic>
+#include <cstddef>  // std::nullptr_t, std::ptrdiff_t
+#include <cstdint>  // SIZE_MAX
+#include <memory>   // std::allocator_traits, std::allocator_arg_t
+#include <new>      // std::align_val_t, std::bad_array_new_length
+#include <tuple>    // std::tie
+#include <type_traits>  // std::enable_if_t, std::is_convertible_v
+#include <utility>  // std::pair
 
 // https://en.cppreference.com/w/cpp/memory/shared_ptr
-class ControlBlockBase {
+// Counting is the same for every block and is done inline; the derived blocks only say how
+// to destroy the object and how to free themselves, and those hooks run only at zero.
+
+// Kept outside of `BasicControlBlock`, so that every counter policy adds to the same total
+class WeakPinnedBlocks {
 public:
-    virtual void IncCounter(bool is_weak = false) {
+    // Bytes of destroyed objects that are still allocated because their blocks have weak
+    // references, over all blocks
+    static size_t WeakPinnedBytes() {
+        return PinnedBytes().load(std::memory_order_relaxed);
+    }
+
+protected:
+    static std::atomic<size_t>& PinnedBytes() {
+        static std::atomic<size_t> bytes = 0;
+        return bytes;
+    }
+};
+
+template <class Base>
+class ImmortalControlBlock;
+
+template <class Counter>
+class BasicControlBlock : public WeakPinnedBlocks {
+public:
+    // The block of every `MakeImmortalShared` object; its counts are never written
+    bool IsImmortal() const {
+        return this == &ImmortalControlBlock<BasicControlBlock>::instance;
+    }
+
+    void IncCounter(bool is_weak = false) {
+        if (IsImmortal()) {
+            return;
+        }
         if (is_weak) {
-            ++weak_counter_;
+            counter_.IncWeak();
         } else {
-            ++strong_counter_;
+            counter_.IncStrong();
+        }
+#ifdef SMART_PTRS_INSTRUMENT
+        if (is_weak) {
+            RefInstrument::Count(type_id_, RefInstrument::kWeakIncrements);
+        } else if (RefInstrument::CountIncrement(type_id_)) {
+            RefInstrument::SeenUseCount(type_id_, counter_.UseCount());
+        }
+#endif
+    }
+    // Take a strong reference only if the object has not been destroyed yet
+    bool TryIncCounter() {
+        if (IsImmortal()) {
+            return true;
+        }
+#ifdef SMART_PTRS_INSTRUMENT
+        if (!counter_.TryIncStrong()) {
+            return false;
+        }
+        if (RefInstrument::CountIncrement(type_id_)) {
+            RefInstrument::SeenUseCount(type_id_, counter_.UseCount());
+        }
+        return true;
+#else
+        return counter_.TryIncStrong();
+#endif
+    }
+    // Strong owners collectively hold one weak reference, so dropping a strong reference is a
+    // single decrement unless it was the last one
+    void DecCounter(bool is_weak = false) {
+        if (IsImmortal()) {
+            return;
+        }
+#ifdef SMART_PTRS_INSTRUMENT
+        RefInstrument::Count(type_id_,
+                             is_weak ? RefInstrument::kWeakDecrements : RefInstrument::kDecrements);
+#endif
+        if (!is_weak) {
+            if (counter_.DecStrong({this, &BasicControlBlock::FinishRelease}) != 0) {
+                return;
+            }
+            ReleaseLastStrong();
+            return;
         }
+        DropWeak();
     }
-    virtual void DecCounter(bool is_weak = false) = 0;
-    virtual size_t GetCounter(bool is_weak = false) {
+    size_t GetCounter(bool is_weak = false) const {
         if (is_weak) {
-            return weak_counter_;
+            return counter_.WeakCount();
         } else {
-            return strong_counter_;
+            return counter_.UseCount();
         }
     }
-    virtual ~ControlBlockBase() = default;
+    // `ShardedRefCount` blocks only: count in one place from now on, so the object can die
+    void SwitchToAtomic() {
+        if (!IsImmortal() && counter_.SwitchToAtomic() == 0) {
+            ReleaseLastStrong();
+        }
+    }
+    virtual ~BasicControlBlock() = default;
 
 protected:
-    size_t strong_counter_ = 1;
-    size_t weak_counter_ = 0;
+    virtual void DestroyObject() = 0;
+    virtual void DestroyBlock() {
+        delete this;
+    }
+    // Storage of the object inside the block itself, which lives as long as the block does
+    virtual size_t InlineBytes() const {
+        return 0;
+    }
+
+    // Derived blocks call this once the object is in place. Only does anything with
+    // SMART_PTRS_INSTRUMENT, where it files the block under `T`.
+    template <class T>
+    void Track() {
+#ifdef SMART_PTRS_INSTRUMENT
+        type_id_ = RefInstrument::Id<T>();
+        RefInstrument::Count(type_id_, RefInstrument::kAllocations);
+#endif
+    }
+
+    Counter counter_;
+
+private:
+    // Destroy the object and drop the weak reference of the strong owners. With weak references
+    // left, the storage counts as pinned until the last of them frees the block. They are counted
+    // after the object is gone, which drops the one `EnableSharedFromThis` holds on itself.
+    void ReleaseLastStrong() {
+        DestroyObject();
+        size_t pinned = 0;
+        if (counter_.WeakCount() > 1) {
+            pinned = InlineBytes();
+#ifdef SMART_PTRS_INSTRUMENT
+            RefInstrument::Count(type_id_, RefInstrument::kWeakExtended);
+#endif
+        }
+        // Added first: the last weak owner may subtract it as soon as `DecWeak` is done
+        if (pinned) {
+            PinnedBytes().fetch_add(pinned, std::memory_order_relaxed);
+        }
+        if (counter_.DecWeak() != 0) {
+            return;
+        }
+        if (pinned) {
+            PinnedBytes().fetch_sub(pinned, std::memory_order_relaxed);
+        }
+        FreeBlock();
+    }
+    void DropWeak() {
+        if (counter_.DecWeak() == 0) {
+            // Whatever the object left in the block was pinned until now. Split and adopted
+            // blocks left nothing, and skip the shared counter.
+            if (size_t pinned = InlineBytes()) {
+                PinnedBytes().fetch_sub(pinned, std::memory_order_relaxed);
+            }
+            FreeBlock();
+        }
+    }
+    void FreeBlock() {
+#ifdef SMART_PTRS_INSTRUMENT
+        RefInstrument::Count(type_id_, RefInstrument::kFrees);
+#endif
+        DestroyBlock();
+    }
+
+    // `DeferredRelease::finish` of every block. The counter's weak reference is not a user's,
+    // so it goes before `ReleaseLastStrong` counts who keeps the block alive. The strong owners'
+    // reference is still there, so it cannot be the last one.
+    static void FinishRelease(void* ptr, size_t left) {
+        auto block = static_cast<BasicControlBlock*>(ptr);
+        if (left == 0) {
+            block->counter_.DecWeak();
+            block->ReleaseLastStrong();
+        } else {
+            block->DropWeak();
+        }
+    }
+
+#ifdef SMART_PTRS_INSTRUMENT
+    size_t type_id_ = 0;
+#endif
 };
 
+// Blocks with the build-wide counter policy
+using ControlBlockBase = BasicControlBlock<SharedCounter>;
+
+// Specialize as `std::true_type` for types that never have a `WeakPtr` taken. Their control
+// blocks keep only the strong count, and `WeakPtr` or `EnableSharedFromThis` fail to compile.
+// Conversions and aliasing only work between types with the same setting.
 template <class T>
-class ControlBlockPtr : public ControlBlockBase {
+struct DisableWeakPtr : std::false_type {};
+
+// Same hooks as `ControlBlockBase`, without the weak count
+class StrongControlBlockBase {
 public:
-    ControlBlockPtr() : pointer_(nullptr){};
-    ControlBlockPtr(T* pointer) : pointer_(pointer){};
-    void DecCounter(bool is_weak = false) override {
-        if (is_weak) {
-            --weak_counter_;
-        } else {
-            --strong_counter_;
+    bool IsImmortal() const;
+
+    void IncCounter() {
+        if (IsImmortal()) {
+            return;
+        }
+        counter_.IncStrong();
+#ifdef SMART_PTRS_INSTRUMENT
+        if (RefInstrument::CountIncrement(type_id_)) {
+            RefInstrument::SeenUseCount(type_id_, counter_.UseCount());
         }
-        if (!is_weak && strong_counter_ == 0) {
-            delete pointer_;
-            pointer_ = nullptr;
+#endif
+    }
+    void DecCounter() {
+        if (IsImmortal()) {
+            return;
         }
-        if (strong_counter_ == 0 && weak_counter_ == 0) {
-            delete this;
+#ifdef SMART_PTRS_INSTRUMENT
+        RefInstrument::Count(type_id_, RefInstrument::kDecrements);
+#endif
+        if (counter_.DecStrong() != 0) {
+            return;
         }
+#ifdef SMART_PTRS_INSTRUMENT
+        RefInstrument::Count(type_id_, RefInstrument::kFrees);
+#endif
+        DestroyObject();
+        DestroyBlock();
+    }
+    size_t GetCounter() const {
+        return counter_.UseCount();
     }
+    virtual ~StrongControlBlockBase() = default;
+
+protected:
+    virtual void DestroyObject() = 0;
+    virtual void DestroyBlock() {
+        delete this;
+    }
+    // Nothing can pin the storage here
+    virtual size_t InlineBytes() const {
+        return 0;
+    }
+
+    template <class T>
+    void Track() {
+#ifdef SMART_PTRS_INSTRUMENT
+        type_id_ = RefInstrument::Id<T>();
+        RefInstrument::Count(type_id_, RefInstrument::kAllocations);
+#endif
+    }
+
+    StrongCounter counter_;
 
 private:
-    T* pointer_;
+#ifdef SMART_PTRS_INSTRUMENT
+    size_t type_id_ = 0;
+#endif
 };
 
+// Specialize as `std::true_type` for a few objects that nearly every thread keeps copying, such
+// as a global configuration. Their blocks count strong references in `ShardedCount` slots, and
+// the object is never destroyed before `SharedPtr::SwitchToAtomic` is called on one of its
+// owners. Conversions and aliasing only work between types with the same setting, and
+// `DisableWeakPtr` wins over this one. Arrays are looked up as themselves: a `MakeShared<E[]>`
+// block is sharded only if `ShardedRefCount<E[]>` is specialized too, not just `E`.
 template <class T>
-class ControlBlockBuffer : public ControlBlockBase {
+struct ShardedRefCount : std::false_type {};
+
+// One static block per block base, shared by all immortal objects. The counting hooks return
+// before touching it, so its counts keep their initial values and nothing is ever destroyed.
+template <class Base>
+class ImmortalControlBlock : public Base {
+public:
+    static ImmortalControlBlock instance;
+
+protected:
+    void DestroyObject() override {
+    }
+    void DestroyBlock() override {
+    }
+};
+
+template <class Base>
+ImmortalControlBlock<Base> ImmortalControlBlock<Base>::instance;
+
+inline bool StrongControlBlockBase::IsImmortal() const {
+    return this == &ImmortalControlBlock<StrongControlBlockBase>::instance;
+}
+
+// Common base of every block made for `T`
+template <class T>
+using ControlBlockFor = std::conditional_t<
+    DisableWeakPtr<std::remove_cv_t<T>>::value, StrongControlBlockBase,
+    std::conditional_t<ShardedRefCount<std::remove_cv_t<T>>::value,
+                       BasicControlBlock<ShardedSharedCounter>, ControlBlockBase>>;
+
+// For `T` = `E[]` and `E[N]`, as in `std::shared_ptr`: a `SharedPtr<T>` adopts a `U*` and
+// converts from a `SharedPtr<U[]>` only if `U` is `E` up to qualifiers. `delete[]` and indexing
+// through a base class pointer are undefined. Other `T` take any `U`.
+template <class T, class U>
+inline constexpr bool kAdoptable =
+    !std::is_array_v<T> || std::is_convertible_v<U (*)[], std::remove_extent_t<T> (*)[]>;
+template <class T, class U>
+inline constexpr bool kConvertible =
+    !std::is_array_v<T> || (std::is_array_v<U> && kAdoptable<T, std::remove_extent_t<U>>);
+
+// `delete` or `delete[]`, depending on `T`
+template <class T>
+using DefaultSharedDelete =
+    Slug<std::conditional_t<std::is_array_v<T>, std::remove_extent_t<T>[], T>>;
+
+// A stateless deleter takes no space thanks to `CompressedPair`
+template <class T, class Deleter = DefaultSharedDelete<T>>
+class ControlBlockPtr : public ControlBlockFor<T> {
+public:
+    using ElementType = std::remove_extent_t<T>;
+
+    ControlBlockPtr() : data_(nullptr, Deleter()) {
+        this->template Track<T>();
+    }
+    ControlBlockPtr(ElementType* pointer) : data_(pointer, Deleter()) {
+        this->template Track<T>();
+    }
+    ControlBlockPtr(ElementType* pointer, Deleter deleter) : data_(pointer, std::move(deleter)) {
+        this->template Track<T>();
+    }
+
+protected:
+    void DestroyObject() override {
+        data_.GetSecond()(data_.GetFirst());
+        data_.GetFirst() = nullptr;
+    }
+
+private:
+    CompressedPair<ElementType*, Deleter> data_;
+};
+
+// Tag for blocks that default-initialize instead of value-initializing
+struct ForOverwrite {};
+
+template <class T>
+class ControlBlockBuffer : public ControlBlockFor<T> {
 public:
     template <typename... Args>
     ControlBlockBuffer(Args&&... args) {
         new (&data_) T(std::forward<Args>(args)...);
+        this->template Track<T>();
+    }
+    explicit ControlBlockBuffer(ForOverwrite) {
+        new (&data_) T;
+        this->template Track<T>();
+    }
+    T* GetObserved() {
+        return reinterpret_cast<T*>(&data_);
     }
-    void DecCounter(bool is_weak = false) {
-        if (is_weak) {
-            --weak_counter_;
-        } else {
-            --strong_counter_;
-        }
 
-        if (!is_weak && strong_counter_ == 0) {
-            reinterpret_cast<T*>(&data_)->~T();
-        }
-        if (strong_counter_ == 0 && weak_counter_ == 0) {
-            delete this;
+protected:
+    void DestroyObject() override {
+        GetObserved()->~T();
+    }
+    size_t InlineBytes() const override {
+        return sizeof(T);
+    }
+
+private:
+    std::aligned_storage_t<sizeof(T), alignof(T)> data_;
+};
+
+// Control block, element count and the elements of `T` = `E[]` or `E[N]` in one allocation
+template <class T>
+class ControlBlockArray : public ControlBlockFor<T> {
+public:
+    using ElementType = std::remove_extent_t<T>;
+    static_assert(!std::is_array_v<ElementType>, "only one-dimensional arrays are supported");
+
+    // Larger sizes would wrap the size of the allocation
+    static constexpr size_t MaxSize() {
+        return (SIZE_MAX - ElementsOffset()) / sizeof(ElementType);
+    }
+
+    static ControlBlockArray* Create(size_t size, bool for_overwrite) {
+        if (size > MaxSize()) {
+            throw std::bad_array_new_length();
         }
-        /*if (is_weak) {
-            if (strong_counter_ == 0) {
-                if (weak_counter_ == 0) {
-                    //reinterpret_cast<T*>(&data_)->~T();
-                    delete this;
+        void* memory = Allocate(ElementsOffset() + size * sizeof(ElementType));
+        auto block = new (memory) ControlBlockArray(size);
+        ElementType* elements = block->GetObserved();
+        size_t constructed = 0;
+        try {
+            for (; constructed < size; ++constructed) {
+                if (for_overwrite) {
+                    new (elements + constructed) ElementType;
                 } else {
-                    reinterpret_cast<T*>(&data_)->~T();
+                    new (elements + constructed) ElementType();
                 }
             }
+        } catch (...) {
+            block->size_ = constructed;
+            block->DestroyObject();
+            block->DestroyBlock();
+            throw;
+        }
+        block->template Track<T>();
+        return block;
+    }
+
+    ElementType* GetObserved() {
+        return reinterpret_cast<ElementType*>(reinterpret_cast<char*>(this) + ElementsOffset());
+    }
+    size_t Size() const {
+        return size_;
+    }
+
+protected:
+    void DestroyObject() override {
+        ElementType* elements = GetObserved();
+        for (size_t i = size_; i > 0; --i) {
+            elements[i - 1].~ElementType();
+        }
+    }
+    void DestroyBlock() override {
+        this->~ControlBlockArray();
+        Deallocate(this);
+    }
+    size_t InlineBytes() const override {
+        return size_ * sizeof(ElementType);
+    }
+
+private:
+    explicit ControlBlockArray(size_t size) : size_(size){};
+
+    static constexpr size_t ElementsOffset() {
+        return (sizeof(ControlBlockArray) + alignof(ElementType) - 1) / alignof(ElementType) *
+               alignof(ElementType);
+    }
+    // The block itself can be the stricter one, e.g. with `ShardedRefCount`
+    static constexpr size_t Alignment() {
+        return std::max(alignof(ControlBlockArray), alignof(ElementType));
+    }
+    static constexpr bool IsOveraligned() {
+        return Alignment() > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+    }
+    static void* Allocate(size_t bytes) {
+        if constexpr (IsOveraligned()) {
+            return ::operator new(bytes, std::align_val_t(Alignment()));
         } else {
-            if (strong_counter_ == 0) {
-                if (weak_counter_ == 0) {
-                    reinterpret_cast<T*>(&data_)->~T();
-                    delete this;
-                } else {
-                    reinterpret_cast<T*>(&data_)->~T();
-                }
-            }
-        }*/
+            return ::operator new(bytes);
+        }
     }
-    T* GetObserved() {
-        return reinterpret_cast<T*>(&data_);
+    static void Deallocate(void* memory) {
+        if constexpr (IsOveraligned()) {
+            ::operator delete(memory, std::align_val_t(Alignment()));
+        } else {
+            ::operator delete(memory);
+        }
     }
 
+    size_t size_;
+};
+
+// Control block that was created by, and frees itself through, an allocator.
+// A stateless allocator takes no space thanks to `CompPairBlock`.
+template <class Block, class Alloc>
+class ControlBlockAlloc final
+    : public Block,
+      private CompPairBlock<typename std::allocator_traits<Alloc>::template rebind_alloc<
+                                ControlBlockAlloc<Block, Alloc>>,
+                            true> {
+    using BlockAlloc =
+        typename std::allocator_traits<Alloc>::template rebind_alloc<ControlBlockAlloc>;
+    using AllocBase = CompPairBlock<BlockAlloc, true>;
+
+public:
+    template <typename... Args>
+    ControlBlockAlloc(const BlockAlloc& alloc, Args&&... args)
+        : Block(std::forward<Args>(args)...), AllocBase(alloc) {
+    }
+
+    template <typename... Args>
+    static ControlBlockAlloc* Create(const Alloc& alloc, Args&&... args) {
+        BlockAlloc block_alloc(alloc);
+        auto block = std::allocator_traits<BlockAlloc>::allocate(block_alloc, 1);
+        try {
+            return new (std::addressof(*block))
+                ControlBlockAlloc(block_alloc, std::forward<Args>(args)...);
+        } catch (...) {
+            std::allocator_traits<BlockAlloc>::deallocate(block_alloc, block, 1);
+            throw;
+        }
+    }
+
+protected:
+    void DestroyBlock() override {
+        BlockAlloc alloc(std::move(AllocBase::Get()));
+        this->~ControlBlockAlloc();
+        std::allocator_traits<BlockAlloc>::deallocate(alloc, this, 1);
+    }
+};
+
+// Every block the library allocates on its own goes through here.
+// Define SMART_PTRS_POOL_CONTROL_BLOCKS to take them from `BlockPool` instead of global `new`.
+template <class Block, typename... Args>
+Block* NewControlBlock(Args&&... args) {
+#ifdef SMART_PTRS_POOL_CONTROL_BLOCKS
+    return ControlBlockAlloc<Block, BlockPoolAllocator<Block>>::Create(
+        BlockPoolAllocator<Block>(), std::forward<Args>(args)...);
+#else
+    return new Block(std::forward<Args>(args)...);
+#endif
+}
+
+// Sole owner of a `MakeUniqueShareable` object. The object already lives in a `MakeShared` block,
+// which `SharedPtr(ShareableUniquePtr&&)` takes over without allocating. There is no `Release`
+// or `Reset(ptr)`: the pointer cannot be separated from its block.
+template <typename T>
+class ShareableUniquePtr {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    ShareableUniquePtr() : block_(nullptr), observed_(nullptr){};
+    ShareableUniquePtr(std::nullptr_t) : block_(nullptr), observed_(nullptr){};
+    ShareableUniquePtr(ShareableUniquePtr&& other) noexcept
+        : block_(other.block_), observed_(other.observed_) {
+        other.block_ = nullptr;
+        other.observed_ = nullptr;
+    }
+    template <class U>
+    ShareableUniquePtr(ShareableUniquePtr<U>&& other) noexcept
+        : block_(other.block_), observed_(other.observed_) {
+        other.block_ = nullptr;
+        other.observed_ = nullptr;
+    }
+    ShareableUniquePtr(const ShareableUniquePtr&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    ShareableUniquePtr& operator=(ShareableUniquePtr&& other) noexcept {
+        ShareableUniquePtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+    template <class U>
+    ShareableUniquePtr& operator=(ShareableUniquePtr<U>&& other) noexcept {
+        ShareableUniquePtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+    ShareableUniquePtr& operator=(std::nullptr_t) noexcept {
+        Reset();
+        return *this;
+    }
+    ShareableUniquePtr& operator=(const ShareableUniquePtr&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    // The strong count is still the initial one, so this destroys the object and frees the block
+    ~ShareableUniquePtr() {
+        if (block_) {
+            block_->DecCounter();
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset() {
+        ShareableUniquePtr().Swap(*this);
+    }
+    void Swap(ShareableUniquePtr& other) {
+        std::swap(block_, other.block_);
+        std::swap(observed_, other.observed_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const {
+        return observed_;
+    }
+    std::add_lvalue_reference_t<T> operator*() const {
+        return *observed_;
+    }
+    T* operator->() const {
+        return observed_;
+    }
+    explicit operator bool() const {
+        return observed_ != nullptr;
+    }
+
+    template <typename U, typename... Args>
+    friend ShareableUniquePtr<U> MakeUniqueShareable(Args&&... args);
+
 private:
-    std::aligned_storage_t<sizeof(T), alignof(T)> data_;
+    template <class U>
+    friend class ShareableUniquePtr;
+    template <class U>
+    friend class SharedPtr;
+    ControlBlockFor<T>* block_;
+    T* observed_;
 };
 
 class EnableSharedFromThisBase {};
@@ -112,6 +625,13 @@ public:
     SharedPtr<const T> SharedFromThis() const {
         return SharedPtr<T>(weak_this_);
     }
+    // Empty instead of `BadWeakPtr` when the object is not owned by a `SharedPtr` (yet or any more)
+    SharedPtr<T> TrySharedFromThis() noexcept {
+        return weak_this_.Lock();
+    }
+    SharedPtr<const T> TrySharedFromThis() const noexcept {
+        return weak_this_.Lock();
+    }
 
     WeakPtr<T> WeakFromThis() noexcept {
         return weak_this_;
@@ -129,18 +649,48 @@ private:
 template <typename T>
 class SharedPtr {
 public:
+    // `T` itself, or `E` for `T` = `E[]` and `E[N]`
+    using ElementType = std::remove_extent_t<T>;
+
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
     SharedPtr() : block_(nullptr), observed_(nullptr){};
     SharedPtr(std::nullptr_t) : block_(nullptr), observed_(nullptr){};
-    explicit SharedPtr(T* ptr) : block_(new ControlBlockPtr<T>(ptr)), observed_(ptr) {
-        if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+    // `ptr` is deleted if the control block cannot be allocated, as with the deleter overloads
+    explicit SharedPtr(ElementType* ptr) : SharedPtr(ptr, DefaultSharedDelete<T>()){};
+    template <class U, std::enable_if_t<kAdoptable<T, U>, int> = 0>
+    explicit SharedPtr(U* ptr) : SharedPtr(ptr, DefaultSharedDelete<Adopted<U>>()){};
+    // Otherwise a `Derived*` would reach `SharedPtr<Base[]>(ElementType*)` as a `Base*`
+    template <class U, std::enable_if_t<!kAdoptable<T, U>, int> = 0>
+    explicit SharedPtr(U* ptr) = delete;
+    // Same as above, but the control block is allocated and freed with `alloc`
+    template <class U, class Alloc, std::enable_if_t<kAdoptable<T, U>, int> = 0>
+    SharedPtr(std::allocator_arg_t, const Alloc& alloc, U* ptr)
+        : SharedPtr(ptr, DefaultSharedDelete<Adopted<U>>(), alloc){};
+    // `deleter(ptr)` runs instead of `delete` when the last owner goes away, or right away if
+    // the control block cannot be allocated
+    template <class U, class Deleter, std::enable_if_t<kAdoptable<T, U>, int> = 0>
+    SharedPtr(U* ptr, Deleter deleter) : block_(nullptr), observed_(ptr) {
+        try {
+            block_ = NewControlBlock<ControlBlockPtr<Adopted<U>, Deleter>>(ptr, std::move(deleter));
+        } catch (...) {
+            deleter(ptr);
+            throw;
+        }
+        if constexpr (std::is_convertible_v<U*, EnableSharedFromThisBase*>) {
             InitWeakThis(ptr);
         }
     };
-    template <class U>
-    explicit SharedPtr(U* ptr) : block_(new ControlBlockPtr<U>(ptr)), observed_(ptr) {
+    template <class U, class Deleter, class Alloc, std::enable_if_t<kAdoptable<T, U>, int> = 0>
+    SharedPtr(U* ptr, Deleter deleter, const Alloc& alloc) : block_(nullptr), observed_(ptr) {
+        try {
+            block_ = ControlBlockAlloc<ControlBlockPtr<Adopted<U>, Deleter>, Alloc>::Create(
+                alloc, ptr, std::move(deleter));
+        } catch (...) {
+            deleter(ptr);
+            throw;
+        }
         if constexpr (std::is_convertible_v<U*, EnableSharedFromThisBase*>) {
             InitWeakThis(ptr);
         }
@@ -158,7 +708,7 @@ public:
         other.block_ = nullptr;
         other.observed_ = nullptr;
     }
-    template <class U>
+    template <class U, std::enable_if_t<kConvertible<T, U>, int> = 0>
     SharedPtr(const SharedPtr<U>& other) {
         block_ = other.block_;
         observed_ = other.observed_;
@@ -166,7 +716,7 @@ public:
             block_->IncCounter();
         }
     }
-    template <class U>
+    template <class U, std::enable_if_t<kConvertible<T, U>, int> = 0>
     SharedPtr(SharedPtr<U>&& other) noexcept {
         block_ = std::move(other.block_);
         observed_ = std::move(other.observed_);
@@ -177,7 +727,7 @@ public:
     // Aliasing constructor
     // #8 from https://en.cppreference.com/w/cpp/memory/shared_ptr/shared_ptr
     template <typename Y>
-    SharedPtr(const SharedPtr<Y>& other, T* ptr) {
+    SharedPtr(const SharedPtr<Y>& other, ElementType* ptr) {
         block_ = other.block_;
         observed_ = ptr;
         if (block_) {
@@ -185,88 +735,65 @@ public:
         }
     }
 
+    // The deleter moves into the new control block
+    // #13 from https://en.cppreference.com/w/cpp/memory/shared_ptr/shared_ptr
+    template <class U, class E, std::enable_if_t<kConvertible<T, U>, int> = 0>
+    SharedPtr(UniquePtr<U, E>&& other) : block_(nullptr), observed_(nullptr) {
+        static_assert(std::is_array_v<T> == std::is_array_v<U>, "arrays only convert to arrays");
+        auto ptr = other.Get();
+        if (!ptr) {
+            return;
+        }
+        // `E` deletes `U`, which may differ from `T` in qualifiers
+        block_ = NewControlBlock<ControlBlockPtr<U, E>>(ptr, std::move(other.GetDeleter()));
+        observed_ = other.Release();
+        if constexpr (std::is_convertible_v<U*, EnableSharedFromThisBase*>) {
+            InitWeakThis(ptr);
+        }
+    }
+    // Takes over the block reserved by `MakeUniqueShareable`, no allocation
+    template <class U>
+    SharedPtr(ShareableUniquePtr<U>&& other) : block_(other.block_), observed_(other.observed_) {
+        U* ptr = other.observed_;
+        other.block_ = nullptr;
+        other.observed_ = nullptr;
+        if (!ptr) {
+            return;
+        }
+        if constexpr (std::is_convertible_v<U*, EnableSharedFromThisBase*>) {
+            InitWeakThis(ptr);
+        }
+    }
+
     // Promote `WeakPtr`
     // #11 from https://en.cppreference.com/w/cpp/memory/shared_ptr/shared_ptr
     explicit SharedPtr(const WeakPtr<T>& other) {
-        if (other.Expired()) {
+        if (!other.block_ || !other.block_->TryIncCounter()) {
             throw BadWeakPtr();
         }
         block_ = other.block_;
         observed_ = other.observed_;
-        if (block_) {
-            block_->IncCounter();
-        }
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // `operator=`-s
 
     SharedPtr& operator=(const SharedPtr& other) {
-        if (block_ == other.block_) {
-            return *this;
-        }
-        if (block_) {
-            block_->DecCounter();
-            /*if (block_->GetCounter() == 0 && block_->GetCounter(true) == 0) {
-                delete block_;
-            }*/
-        }
-        block_ = other.block_;
-        observed_ = other.observed_;
-        if (block_) {
-            block_->IncCounter();
-        }
+        SharedPtr(other).Swap(*this);
         return *this;
     }
     SharedPtr& operator=(SharedPtr&& other) noexcept {
-        if (block_ == other.block_) {
-            return *this;
-        }
-        if (block_) {
-            block_->DecCounter();
-            /*if (block_->GetCounter() == 0 && block_->GetCounter(true) == 0) {
-                delete block_;
-            }*/
-        }
-        block_ = std::move(other.block_);
-        observed_ = std::move(other.observed_);
-        other.block_ = nullptr;
-        other.observed_ = nullptr;
+        SharedPtr(std::move(other)).Swap(*this);
         return *this;
     }
-    template <class U>
+    template <class U, std::enable_if_t<kConvertible<T, U>, int> = 0>
     SharedPtr& operator=(const SharedPtr<U>& other) {
-        if (block_ == other.block_) {
-            return *this;
-        }
-        if (block_) {
-            block_->DecCounter();
-            /*if (block_->GetCounter() == 0 && block_->GetCounter(true) == 0) {
-                delete block_;
-            }*/
-        }
-        block_ = other.block_;
-        observed_ = other.observed_;
-        if (block_) {
-            block_->IncCounter();
-        }
+        SharedPtr(other).Swap(*this);
         return *this;
     }
-    template <class U>
+    template <class U, std::enable_if_t<kConvertible<T, U>, int> = 0>
     SharedPtr& operator=(SharedPtr<U>&& other) noexcept {
-        if (block_ == other.block_) {
-            return *this;
-        }
-        if (block_) {
-            block_->DecCounter();
-            /*if (block_->GetCounter() == 0 && block_->GetCounter(true) == 0) {
-                delete block_;
-            }*/
-        }
-        block_ = std::move(other.block_);
-        observed_ = std::move(other.observed_);
-        other.block_ = nullptr;
-        other.observed_ = nullptr;
+        SharedPtr(std::move(other)).Swap(*this);
         return *this;
     }
 
@@ -274,14 +801,8 @@ public:
     // Destructor
 
     ~SharedPtr() {
-        // WeakPtr<T> tmp(*this);
         if (block_) {
-            block_->IncCounter(true);
             block_->DecCounter();
-            block_->DecCounter(true);
-            /*if (block_->GetCounter() == 0 && block_->GetCounter(true) == 0) {
-                delete block_;
-            }*/
         }
     }
 
@@ -290,58 +811,55 @@ public:
 
     void Reset() {
         if (block_) {
-            block_->IncCounter(true);
             block_->DecCounter();
-            block_->DecCounter(true);
-            /*if (block_->GetCounter() == 0 && block_->GetCounter(true) == 0) {
-                delete block_;
-            }*/
             block_ = nullptr;
-            observed_ = nullptr;
         }
+        observed_ = nullptr;
     }
-    void Reset(T* ptr) {
-        if (block_) {
-            block_->IncCounter(true);
-            block_->DecCounter();
-            block_->DecCounter(true);
-            /*if (block_->GetCounter() == 0 && block_->GetCounter(true) == 0) {
-                delete block_;
-            }*/
-        }
-        block_ = new ControlBlockPtr<T>(ptr);
-        observed_ = ptr;
+    // The new block is made before the old one is released, so a failed allocation deletes
+    // `ptr` and leaves `*this` as it was
+    void Reset(ElementType* ptr) {
+        SharedPtr(ptr).Swap(*this);
     }
-    template <class U>
+    template <class U, std::enable_if_t<kAdoptable<T, U>, int> = 0>
     void Reset(U* ptr) {
-        if (block_) {
-            block_->IncCounter(true);
-            block_->DecCounter();
-            block_->DecCounter(true);
-            /*if (block_->GetCounter() == 0 && block_->GetCounter(true) == 0) {
-                delete block_;
-            }*/
-        }
-        block_ = new ControlBlockPtr<U>(ptr);
-        observed_ = ptr;
+        SharedPtr(ptr).Swap(*this);
+    }
+    template <class U, std::enable_if_t<!kAdoptable<T, U>, int> = 0>
+    void Reset(U* ptr) = delete;
+    template <class U, class Deleter, std::enable_if_t<kAdoptable<T, U>, int> = 0>
+    void Reset(U* ptr, Deleter deleter) {
+        SharedPtr(ptr, std::move(deleter)).Swap(*this);
     }
     void Swap(SharedPtr& other) {
         std::swap(block_, other.block_);
         std::swap(observed_, other.observed_);
     }
+    // For `ShardedRefCount` types, once the object is being torn down: the last owner to go
+    // destroys it from now on. `UseCount` is exact only after this.
+    void SwitchToAtomic() const {
+        if (block_) {
+            block_->SwitchToAtomic();
+        }
+    }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Observers
 
-    T* Get() const {
+    ElementType* Get() const {
         return observed_;
     }
-    T& operator*() const {
+    std::add_lvalue_reference_t<ElementType> operator*() const {
         return *observed_;
     }
-    T* operator->() const {
+    ElementType* operator->() const {
         return observed_;
     }
+    // Array access, for `T` = `E[]` and `E[N]`
+    ElementType& operator[](std::ptrdiff_t i) const {
+        return observed_[i];
+    }
+    // Always 1 for immortal objects
     size_t UseCount() const {
         if (block_) {
             return block_->GetCounter();
@@ -357,36 +875,174 @@ public:
     }
     template <typename U, typename... Args>
     friend SharedPtr<U> MakeShared(Args&&... args);
+    template <typename U, typename... Args>
+    friend SharedPtr<U> MakeImmortalShared(Args&&... args);
+    template <typename U, typename... Args>
+    friend SharedPtr<U> MakeSharedForOverwrite(Args&&... args);
+    template <typename U, typename Alloc, typename... Args>
+    friend SharedPtr<U> AllocateShared(const Alloc& alloc, Args&&... args);
     template <typename S, typename U>
     friend bool operator==(const SharedPtr<S>& left, const SharedPtr<U>& right);
 
 private:
+    // Block type for adopting a `U*`: arrays are always deleted as `T`
+    template <class U>
+    using Adopted = std::conditional_t<std::is_array_v<T>, T, U>;
+
+    // `T` may be a base of `Y`, so the weak pointer gets the `Y*` itself
     template <typename Y>
     void InitWeakThis(EnableSharedFromThis<Y>* e) {
-        e->weak_this_ = *this;
+        WeakPtr<Y> weak_this;
+        weak_this.block_ = block_;
+        weak_this.observed_ = static_cast<Y*>(e);
+        block_->IncCounter(true);
+        e->weak_this_ = std::move(weak_this);
     }
     template <class U>
     friend class SharedPtr;
     template <class U>
     friend class WeakPtr;
-    ControlBlockBase* block_;
-    T* observed_;
+    ControlBlockFor<T>* block_;
+    ElementType* observed_;
 };
 
 template <typename T, typename U>
 inline bool operator==(const SharedPtr<T>& left, const SharedPtr<U>& right) {
-    return (left.block_ == right.block_);
+    // Immortal objects share one block, so only their addresses tell them apart
+    return left.block_ == right.block_ &&
+           (!left.block_ || !left.block_->IsImmortal() || left.observed_ == right.observed_);
+}
+
+// `MakeShared` objects and arrays above this many bytes get an allocation of their own. It is
+// freed together with the object, so a lingering `WeakPtr` pins only the control block.
+#ifndef SMART_PTRS_MAKE_SHARED_SPLIT_BYTES
+#define SMART_PTRS_MAKE_SHARED_SPLIT_BYTES (64 * 1024)
+#endif
+
+template <class T>
+constexpr bool IsSplitForMakeShared(size_t bytes) {
+    return bytes > SMART_PTRS_MAKE_SHARED_SPLIT_BYTES &&
+           !DisableWeakPtr<std::remove_cv_t<T>>::value;
+}
+
+// Block and elements for `MakeShared<E[]>(n)` and `MakeShared<E[N]>()`, or their `ForOverwrite`
+// versions
+template <typename T, typename... Args>
+std::pair<ControlBlockFor<T>*, std::remove_extent_t<T>*> NewSharedArray(bool for_overwrite,
+                                                                        Args... size) {
+    using ElementType = std::remove_extent_t<T>;
+    size_t count = std::extent_v<T>;
+    if constexpr (std::extent_v<T> == 0) {
+        static_assert(sizeof...(Args) == 1, "pass the number of elements");
+        count = (static_cast<size_t>(size), ...);
+    } else {
+        static_assert(sizeof...(Args) == 0, "the number of elements is part of the type");
+    }
+    if (count > ControlBlockArray<T>::MaxSize()) {
+        throw std::bad_array_new_length();
+    }
+    if (IsSplitForMakeShared<T>(count * sizeof(ElementType))) {
+        UniquePtr<ElementType[]> elements(for_overwrite ? new ElementType[count]
+                                                        : new ElementType[count]());
+        auto block = NewControlBlock<ControlBlockPtr<T>>(elements.Get());
+        return {block, elements.Release()};
+    }
+    auto block = ControlBlockArray<T>::Create(count, for_overwrite);
+    return {block, block->GetObserved()};
 }
 
-// Allocate memory only once
+// Allocate memory only once, unless the object is over SMART_PTRS_MAKE_SHARED_SPLIT_BYTES
 template <typename T, typename... Args>
 SharedPtr<T> MakeShared(Args&&... args) {
     SharedPtr<T> ans;
-    auto new_block = new ControlBlockBuffer<T>(std::forward<Args>(args)...);
-    ans.block_ = static_cast<ControlBlockBase*>(new_block);
+    if constexpr (std::is_array_v<T>) {
+        std::tie(ans.block_, ans.observed_) = NewSharedArray<T>(false, args...);
+        return ans;
+    } else if constexpr (IsSplitForMakeShared<T>(sizeof(T))) {
+        UniquePtr<T> object(new T(std::forward<Args>(args)...));
+        ans.block_ = NewControlBlock<ControlBlockPtr<T>>(object.Get());
+        ans.observed_ = object.Release();
+        if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+            ans.InitWeakThis(ans.observed_);
+        }
+        return ans;
+    } else {
+        auto new_block = NewControlBlock<ControlBlockBuffer<T>>(std::forward<Args>(args)...);
+        ans.block_ = new_block;
+        ans.observed_ = new_block->GetObserved();
+        if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+            ans.InitWeakThis(ans.observed_);
+        }
+        return ans;
+    }
+}
+
+// Same as `MakeShared`, but the object or the elements are default-initialized, so trivial types
+// are left uninitialized
+template <typename T, typename... Args>
+SharedPtr<T> MakeSharedForOverwrite(Args&&... args) {
+    SharedPtr<T> ans;
+    if constexpr (std::is_array_v<T>) {
+        std::tie(ans.block_, ans.observed_) = NewSharedArray<T>(true, args...);
+        return ans;
+    } else if constexpr (IsSplitForMakeShared<T>(sizeof(T))) {
+        static_assert(sizeof...(Args) == 0, "objects for overwrite take no arguments");
+        UniquePtr<T> object(new T);
+        ans.block_ = NewControlBlock<ControlBlockPtr<T>>(object.Get());
+        ans.observed_ = object.Release();
+        if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+            ans.InitWeakThis(ans.observed_);
+        }
+        return ans;
+    } else {
+        static_assert(sizeof...(Args) == 0, "objects for overwrite take no arguments");
+        auto new_block = NewControlBlock<ControlBlockBuffer<T>>(ForOverwrite());
+        ans.block_ = new_block;
+        ans.observed_ = new_block->GetObserved();
+        if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+            ans.InitWeakThis(ans.observed_);
+        }
+        return ans;
+    }
+}
+
+// Same as `MakeShared`, but the single allocation comes from `alloc`
+template <typename T, typename Alloc, typename... Args>
+SharedPtr<T> AllocateShared(const Alloc& alloc, Args&&... args) {
+    SharedPtr<T> ans;
+    auto new_block =
+        ControlBlockAlloc<ControlBlockBuffer<T>, Alloc>::Create(alloc, std::forward<Args>(args)...);
+    ans.block_ = new_block;
     ans.observed_ = new_block->GetObserved();
     if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
         ans.InitWeakThis(ans.observed_);
     }
     return ans;
 }
+
+// `MakeUnique` that puts the object into a `MakeShared` block right away, so turning the result
+// into a `SharedPtr` later costs no allocation
+template <typename T, typename... Args>
+ShareableUniquePtr<T> MakeUniqueShareable(Args&&... args) {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+    auto new_block = NewControlBlock<ControlBlockBuffer<T>>(std::forward<Args>(args)...);
+    ShareableUniquePtr<T> ans;
+    ans.block_ = new_block;
+    ans.observed_ = new_block->GetObserved();
+    return ans;
+}
+
+// For objects that live until the process exits. They all share `ImmortalControlBlock`, whose
+// counts copies and releases recognize by address and never write, and nothing ever destroys
+// the object. `UseCount` stays 1, and `WeakPtr`s to it never expire.
+template <typename T, typename... Args>
+SharedPtr<T> MakeImmortalShared(Args&&... args) {
+    static_assert(!std::is_array_v<T>, "arrays are not supported");
+    SharedPtr<T> ans;
+    ans.observed_ = new T(std::forward<Args>(args)...);
+    ans.block_ = &ImmortalControlBlock<ControlBlockFor<T>>::instance;
+    if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+        ans.InitWeakThis(ans.observed_);
+    }
+    return ans;
+}
@@ -11,4 +11,5 @@ class SharedPtr;
 template <typename T>
 class WeakPtr;
 
-class ControlBlockBase;
+template <class Counter>
+class BasicControlBlock;
@@ -0,0 +1,56 @@
+// Array `SharedPtr`s only adopt and convert from their own element type, up to qualifiers.
+
+#include "../shared.h"
+
+#include <cassert>
+#include <cstdio>
+#include <type_traits>
+#include <utility>  // std::move
+
+namespace {
+
+struct Base {
+    int value = 1;
+};
+struct Derived : Base {
+    int extra = 2;
+};
+
+template <class Ptr, class U, class = void>
+struct CanReset : std::false_type {};
+template <class Ptr, class U>
+struct CanReset<Ptr, U, std::void_t<decltype(std::declval<Ptr&>().Reset(std::declval<U*>()))>>
+    : std::true_type {};
+
+// `delete[]` and indexing through `Base*` would be undefined
+static_assert(!std::is_constructible_v<SharedPtr<Base[]>, Derived*>);
+static_assert(!std::is_constructible_v<SharedPtr<Base[3]>, Derived*>);
+static_assert(!std::is_constructible_v<SharedPtr<Base[]>, Derived*, Slug<Derived[]>>);
+static_assert(!std::is_constructible_v<SharedPtr<Base[]>, const SharedPtr<Derived[]>&>);
+static_assert(!std::is_constructible_v<SharedPtr<Base[]>, SharedPtr<Derived[]>&&>);
+static_assert(!std::is_constructible_v<SharedPtr<Base[]>, UniquePtr<Derived[]>&&>);
+static_assert(!std::is_assignable_v<SharedPtr<Base[]>&, const SharedPtr<Derived[]>&>);
+static_assert(!std::is_constructible_v<SharedPtr<int[]>, const SharedPtr<int>&>);
+static_assert(!CanReset<SharedPtr<Base[]>, Derived>::value);
+
+// Qualification conversions are fine, and so is everything for non-arrays
+static_assert(std::is_constructible_v<SharedPtr<const Base[]>, Base*>);
+static_assert(std::is_constructible_v<SharedPtr<const Base[]>, const SharedPtr<Base[]>&>);
+static_assert(std::is_constructible_v<SharedPtr<const Base[]>, SharedPtr<Base[3]>&&>);
+static_assert(std::is_constructible_v<SharedPtr<Base>, Derived*>);
+static_assert(std::is_constructible_v<SharedPtr<Base>, const SharedPtr<Derived>&>);
+static_assert(CanReset<SharedPtr<const Base[]>, Base>::value);
+static_assert(CanReset<SharedPtr<Base>, Derived>::value);
+
+}  // namespace
+
+int main() {
+    SharedPtr<Base[]> bases(new Base[3]);
+    bases.Reset(new Base[2]);
+    assert(bases[1].value == 1);
+    SharedPtr<const Base[]> constant = std::move(bases);
+    assert(constant[0].value == 1 && !bases);
+    SharedPtr<const Base[]> adopted(UniquePtr<Base[]>(new Base[4]));
+    assert(adopted[3].value == 1);
+    std::puts("ok");
+}
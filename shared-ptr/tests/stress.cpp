@@ -0,0 +1,412 @@
+// Copies, drops and locks the same control blocks from many threads, and races the lock-free
+// pointers built on top of them.
+// Built once per counting mode with -fsanitize=thread, see CMakeLists.txt.
+
+#include "../shared.h"
+#include "../weak.h"
+#include "../atomic_shared.h"
+#include "../rcu_cell.h"
+#include "../sharded_count.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <mutex>
+#include <thread>  // std::this_thread::yield
+#include <utility>  // std::move
+#include <vector>
+
+namespace {
+
+constexpr int kThreads = 4;
+constexpr int kRounds = 200;
+constexpr int kIterations = 1000;
+
+struct Tracked {
+    static std::atomic<int> live;
+
+    explicit Tracked(int value) : value(value) {
+        live.fetch_add(1, std::memory_order_relaxed);
+    }
+    ~Tracked() {
+        live.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    int value;
+};
+std::atomic<int> Tracked::live = 0;
+
+template <class Fn>
+void RunThreads(Fn fn) {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; ++i) {
+        threads.emplace_back(fn, i);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Every thread copies, moves and drops its own copies of one object
+void CopyFanOut() {
+    SharedPtr<Tracked> shared = MakeShared<Tracked>(42);
+    RunThreads([copy = shared](int) {
+        for (int i = 0; i < kIterations; ++i) {
+            SharedPtr<Tracked> first = copy;
+            SharedPtr<Tracked> second;
+            second = first;
+            SharedPtr<Tracked> third = std::move(first);
+            assert(third->value == 42 && second.Get() == third.Get());
+        }
+    });
+    assert(shared.UseCount() == 1);
+    shared.Reset();
+    assert(Tracked::live.load() == 0);
+}
+
+// Readers lock a weak pointer while the last strong owner goes away
+void LockRacesLastRelease() {
+    for (int round = 0; round < kRounds; ++round) {
+        SharedPtr<Tracked> shared(new Tracked(round));
+        WeakPtr<Tracked> weak(shared);
+        std::atomic<bool> go = false;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreads; ++i) {
+            threads.emplace_back([&, weak] {
+                while (!go.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                for (int k = 0; k < kIterations / 10; ++k) {
+                    SharedPtr<Tracked> locked = weak.Lock();
+                    if (locked) {
+                        assert(locked->value == round);
+                    }
+                }
+            });
+        }
+        go.store(true, std::memory_order_release);
+        shared.Reset();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        assert(weak.Expired() && !weak.Lock());
+    }
+    assert(Tracked::live.load() == 0);
+}
+
+// Objects are made on one thread and dropped on others, as in a work queue
+void HandOff() {
+    std::mutex mutex;
+    std::vector<SharedPtr<Tracked>> queue;
+    std::atomic<bool> done = false;
+    std::thread producer([&] {
+        for (int i = 0; i < kRounds * 10; ++i) {
+            SharedPtr<Tracked> item = MakeShared<Tracked>(i);
+            // The producer's copy and the consumer's race to be the last one
+            SharedPtr<Tracked> kept = item;
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(std::move(item));
+        }
+        done.store(true, std::memory_order_release);
+    });
+    RunThreads([&](int) {
+        while (true) {
+            SharedPtr<Tracked> item;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!queue.empty()) {
+                    item = std::move(queue.back());
+                    queue.pop_back();
+                }
+            }
+            if (!item) {
+                if (done.load(std::memory_order_acquire)) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (queue.empty()) {
+                        break;
+                    }
+                }
+                std::this_thread::yield();
+            }
+        }
+    });
+    producer.join();
+    assert(Tracked::live.load() == 0);
+}
+
+// The creating thread only ever gives its objects away and never drops a reference itself.
+// Whatever the others dropped is gone once it polls, before it makes the next object.
+void HandAway() {
+    std::mutex mutex;
+    SharedPtr<Tracked> slot;
+    std::atomic<int> dropped = 0;
+    std::thread consumer([&] {
+        for (int i = 0; i < kRounds; ++i) {
+            SharedPtr<Tracked> item;
+            while (!item) {
+                std::lock_guard<std::mutex> lock(mutex);
+                item = std::move(slot);
+            }
+            assert(item->value == i);
+            item.Reset();
+            dropped.store(i + 1, std::memory_order_release);
+        }
+    });
+    std::thread producer([&] {
+        for (int i = 0; i < kRounds; ++i) {
+#ifdef SMART_PTRS_BIASED_COUNTERS
+            BiasedOwner::Poll();
+#endif
+            SharedPtr<Tracked> item = MakeShared<Tracked>(i);
+            assert(Tracked::live.load() == 1);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot = std::move(item);
+            }
+            while (dropped.load(std::memory_order_acquire) != i + 1) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    consumer.join();
+    producer.join();
+    assert(Tracked::live.load() == 0);
+}
+
+// Waits until `counter` reaches `value`
+void AwaitRound(const std::atomic<int>& counter, int value) {
+    while (counter.load(std::memory_order_acquire) < value) {
+        std::this_thread::yield();
+    }
+}
+
+// The creating thread gives two references away. One thread drops the first, which sends the
+// block back to the creator, while another copies the second and returns both copies to the
+// creator, which drops them right away.
+void HandOffRacesOwnerRelease() {
+    SharedPtr<Tracked> dropped;
+    SharedPtr<Tracked> copied;
+    SharedPtr<Tracked> returned[2];
+    std::atomic<int> given = 0;
+    std::atomic<int> copies = 0;
+    std::atomic<int> drops = 0;
+    std::thread owner([&] {
+        for (int i = 0; i < kRounds * 5; ++i) {
+            SharedPtr<Tracked> item = MakeShared<Tracked>(i);
+            copied = item;
+            dropped = std::move(item);
+            given.store(i + 1, std::memory_order_release);
+            AwaitRound(copies, i + 1);
+            returned[0].Reset();
+            returned[1].Reset();
+            AwaitRound(drops, i + 1);
+        }
+    });
+    std::thread dropper([&] {
+        for (int i = 0; i < kRounds * 5; ++i) {
+            AwaitRound(given, i + 1);
+            dropped.Reset();
+            drops.store(i + 1, std::memory_order_release);
+        }
+    });
+    std::thread copier([&] {
+        for (int i = 0; i < kRounds * 5; ++i) {
+            AwaitRound(given, i + 1);
+            returned[0] = copied;
+            returned[1] = std::move(copied);
+            copies.store(i + 1, std::memory_order_release);
+        }
+    });
+    owner.join();
+    dropper.join();
+    copier.join();
+    assert(Tracked::live.load() == 0);
+}
+
+// Writers replace the value with `CompareExchange`, then with `Store`, while readers keep
+// loading it. Either way there is one writer at a time per value, so readers see it grow.
+void AtomicPublish() {
+    {
+        AtomicSharedPtr<Tracked> atomic(MakeShared<Tracked>(0));
+        RunThreads([&](int thread) {
+            if (thread < 2) {
+                for (int i = 0; i < kIterations; ++i) {
+                    SharedPtr<Tracked> expected = atomic.Load();
+                    while (!atomic.CompareExchange(expected,
+                                                   MakeShared<Tracked>(expected->value + 1))) {
+                    }
+                }
+                return;
+            }
+            int last = 0;
+            for (int i = 0; i < kIterations; ++i) {
+                SharedPtr<Tracked> value = atomic.Load();
+                assert(value && value->value >= last);
+                last = value->value;
+            }
+        });
+        assert(atomic.Load()->value == 2 * kIterations);
+
+        RunThreads([&](int thread) {
+            if (thread == 0) {
+                for (int i = 1; i <= kIterations; ++i) {
+                    atomic.Store(MakeShared<Tracked>(2 * kIterations + i));
+                }
+                return;
+            }
+            int last = 0;
+            for (int i = 0; i < kIterations; ++i) {
+                SharedPtr<Tracked> value = atomic.Load();
+                assert(value && value->value >= last);
+                last = value->value;
+            }
+        });
+        assert(atomic.Load()->value == 3 * kIterations);
+    }
+    assert(Tracked::live.load() == 0);
+}
+
+// Every copy is a new version with an id of its own, which records its destruction
+struct Version {
+    static constexpr int kMax = kIterations + 1;
+    static std::atomic<int> next;
+    static std::atomic<int> destroyed[kMax];
+
+    Version() : id(next.fetch_add(1, std::memory_order_relaxed)) {
+    }
+    Version(const Version& other)
+        : id(next.fetch_add(1, std::memory_order_relaxed)), value(other.value) {
+    }
+    ~Version() {
+        alive = false;
+        destroyed[id].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int id;
+    int value = 0;
+    bool alive = true;
+};
+std::atomic<int> Version::next = 0;
+std::atomic<int> Version::destroyed[Version::kMax] = {};
+
+// One writer keeps updating the cell while readers hold guards and owning copies
+void RcuReadersVsUpdates() {
+    {
+        RcuCell<Version> cell;
+        RunThreads([&](int thread) {
+            if (thread == 0) {
+                for (int i = 1; i < Version::kMax; ++i) {
+                    cell.Update([i](Version& version) { version.value = i; });
+                    if (i % 100 == 0) {
+                        cell.Synchronize();
+                        assert(cell.Retired() == 0);
+                    }
+                }
+                return;
+            }
+            int last = 0;
+            for (int i = 0; i < kIterations; ++i) {
+                if (i % 2 == 0) {
+                    auto guard = cell.Read();
+                    assert(guard->alive && guard->value >= last);
+                    last = guard->value;
+                    std::this_thread::yield();
+                    assert(guard->alive && guard->value == last);
+                } else {
+                    SharedPtr<const Version> copy = cell.Load();
+                    assert(copy->alive && copy->value >= last);
+                    last = copy->value;
+                }
+            }
+        });
+    }
+    assert(Version::next.load() == Version::kMax);
+    for (const auto& count : Version::destroyed) {
+        assert(count.load() == 1);
+    }
+}
+
+// Every thread owns one reference and keeps taking and dropping more, while two of them race to
+// switch to the atomic count halfway through. The total stays exact, and it reaches zero once.
+void ShardedSwitch() {
+    ShardedCount count(kThreads);
+    std::atomic<int> switches = 0;
+    std::atomic<int> switched = 0;
+    std::atomic<int> zeros = 0;
+    RunThreads([&](int thread) {
+        for (int i = 0; i < kIterations; ++i) {
+            if (i == kIterations / 2 && thread < 2) {
+                if (count.SwitchToAtomic() != ShardedCount::kNotLast) {
+                    switches.fetch_add(1, std::memory_order_relaxed);
+                }
+                switched.fetch_add(1, std::memory_order_release);
+            }
+            count.Inc();
+            bool taken = count.TryInc();
+            assert(taken);
+            size_t first = count.Dec();
+            size_t second = count.Dec();
+            assert(first != 0 && second != 0);
+        }
+        while (switched.load(std::memory_order_acquire) != 2) {
+            std::this_thread::yield();
+        }
+        if (count.Dec() == 0) {
+            zeros.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    assert(switches.load() == 1 && zeros.load() == 1);
+    assert(count.Count() == 0 && !count.TryInc());
+}
+
+}  // namespace
+
+// Counted in `ShardedCount` slots by its `SharedPtr` blocks
+struct Hot : Tracked {
+    using Tracked::Tracked;
+};
+template <>
+struct ShardedRefCount<Hot> : std::true_type {};
+
+namespace {
+
+// Threads keep copying one sharded object, and one of them starts tearing it down midway
+void ShardedSharedPtr() {
+    for (int round = 0; round < kRounds / 10; ++round) {
+        SharedPtr<Hot> shared = MakeShared<Hot>(round);
+        RunThreads([&, copy = shared](int thread) {
+            for (int i = 0; i < kIterations; ++i) {
+                SharedPtr<Hot> first = copy;
+                SharedPtr<Hot> second = first;
+                assert(second->value == round);
+                if (thread == 0 && i == kIterations / 2) {
+                    second.SwitchToAtomic();
+                }
+            }
+        });
+        assert(shared.UseCount() == 1);
+        shared.Reset();
+        assert(Tracked::live.load() == 0);
+    }
+}
+
+}  // namespace
+
+int main() {
+    CopyFanOut();
+    LockRacesLastRelease();
+    HandOff();
+    HandAway();
+    HandOffRacesOwnerRelease();
+    AtomicPublish();
+    RcuReadersVsUpdates();
+    ShardedSwitch();
+    ShardedSharedPtr();
+#ifdef SMART_PTRS_INSTRUMENT
+    // Counted on many threads, most of which are gone by now, and still every block is freed
+    for (const RefTypeStats& stats : RefInstrument::Snapshot()) {
+        assert(stats.Live() == 0 && stats.increments > 0);
+    }
+#endif
+    std::puts("ok");
+}
@@ -45,6 +45,8 @@ public:
     // #2 from https://en.cppreference.com/w/cpp/memory/weak_ptr/weak_ptr
     template <class U>
     WeakPtr(const SharedPtr<U>& other) {
+        static_assert(!DisableWeakPtr<std::remove_cv_t<U>>::value,
+                      "the type opted out of weak references with DisableWeakPtr");
         block_ = other.block_;
         observed_ = other.observed_;
         if (block_) {
@@ -56,30 +58,11 @@ public:
     // `operator=`-s
 
     WeakPtr& operator=(const WeakPtr& other) {
-        if (block_ == other.block_) {
-            return *this;
-        }
-        if (block_) {
-            block_->DecCounter(true);
-        }
-        block_ = other.block_;
-        observed_ = other.observed_;
-        if (block_) {
-            block_->IncCounter(true);
-        }
+        WeakPtr(other).Swap(*this);
         return *this;
     }
     WeakPtr& operator=(WeakPtr&& other) noexcept {
-        if (block_ == other.block_) {
-            return *this;
-        }
-        if (block_) {
-            block_->DecCounter(true);
-        }
-        block_ = std::move(other.block_);
-        observed_ = std::move(other.observed_);
-        other.block_ = nullptr;
-        other.observed_ = nullptr;
+        WeakPtr(std::move(other)).Swap(*this);
         return *this;
     }
 
@@ -119,11 +102,14 @@ public:
     bool Expired() const {
         return (UseCount() == 0);
     }
-    SharedPtr<T> Lock() const {
-        if (!Expired()) {
-            return SharedPtr<T>(*this);
+    // One increment-if-nonzero on the counter; empty if the object is already gone
+    SharedPtr<T> Lock() const noexcept {
+        SharedPtr<T> ans;
+        if (block_ && block_->TryIncCounter()) {
+            ans.block_ = block_;
+            ans.observed_ = observed_;
         }
-        return SharedPtr<T>();
+        return ans;
     }
 
 private:
@@ -131,6 +117,6 @@ private:
     friend class SharedPtr;
     template <class U>
     friend class WeakPtr;
-    ControlBlockBase* block_;
-    T* observed_;
+    ControlBlockFor<T>* block_;
+    std::remove_extent_t<T>* observed_;
 };
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "unique.h"
+
+#include <algorithm>  // std::max
+#include <cstddef>    // size_t, std::max_align_t
+#include <cstdint>    // uintptr_t, SIZE_MAX
+#include <new>        // std::bad_alloc, std::bad_array_new_length
+#include <type_traits>
+#include <utility>  // std::forward
+
+// Monotonic region: allocations bump a cursor through large chunks and are never freed one by
+// one. `Reset` gives everything back at once and keeps the newest regular-sized chunk for reuse;
+// chunks made larger for a single big allocation are always freed. Objects made with
+// `MakeUniqueIn` have to be destroyed before the arena is reset or destroyed.
+class Arena {
+public:
+    static constexpr size_t kDefaultChunkSize = 64 * 1024;
+
+    explicit Arena(size_t chunk_size = kDefaultChunkSize) : chunk_size_(chunk_size){};
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() {
+        while (chunks_) {
+            Chunk* next = chunks_->next;
+            ::operator delete(chunks_);
+            chunks_ = next;
+        }
+    }
+
+    void* Allocate(size_t bytes, size_t alignment = alignof(std::max_align_t)) {
+        if (bytes > SIZE_MAX - alignment - sizeof(Chunk)) {
+            throw std::bad_alloc();
+        }
+        uintptr_t begin = (cursor_ + alignment - 1) & ~(alignment - 1);
+        if (!chunks_ || begin + bytes > end_) {
+            NewChunk(bytes + alignment);
+            begin = (cursor_ + alignment - 1) & ~(alignment - 1);
+        }
+        cursor_ = begin + bytes;
+        return reinterpret_cast<void*>(begin);
+    }
+
+    void Reset() {
+        Chunk* kept = nullptr;
+        while (chunks_) {
+            Chunk* next = chunks_->next;
+            if (!kept && chunks_->size == chunk_size_) {
+                kept = chunks_;
+                kept->next = nullptr;
+            } else {
+                ::operator delete(chunks_);
+            }
+            chunks_ = next;
+        }
+        chunks_ = kept;
+        cursor_ = kept ? reinterpret_cast<uintptr_t>(kept + 1) : 0;
+        end_ = kept ? reinterpret_cast<uintptr_t>(kept) + kept->size : 0;
+    }
+
+private:
+    struct alignas(std::max_align_t) Chunk {
+        Chunk* next;
+        size_t size;  // with the header
+    };
+
+    void NewChunk(size_t min_size) {
+        size_t size = std::max(chunk_size_, min_size + sizeof(Chunk));
+        auto chunk = static_cast<Chunk*>(::operator new(size));
+        chunk->next = chunks_;
+        chunk->size = size;
+        chunks_ = chunk;
+        cursor_ = reinterpret_cast<uintptr_t>(chunk + 1);
+        end_ = reinterpret_cast<uintptr_t>(chunk) + size;
+    }
+
+    size_t chunk_size_;
+    Chunk* chunks_ = nullptr;
+    uintptr_t cursor_ = 0;
+    uintptr_t end_ = 0;
+};
+
+// Runs the destructor only; the memory goes back when the arena is reset
+template <class T>
+struct ArenaDeleter {
+    ArenaDeleter() = default;
+    template <class U>
+    ArenaDeleter(const ArenaDeleter<U>&){};
+    void operator()(T* ptr) {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            if (ptr) {
+                ptr->~T();
+            }
+        }
+    }
+};
+
+// Arrays that need destructors keep their length in front of the first element
+template <class T>
+struct ArenaDeleter<T[]> {
+    static constexpr size_t kCookie = std::max(sizeof(size_t), alignof(T));
+
+    ArenaDeleter() = default;
+    template <class U>
+    ArenaDeleter(const ArenaDeleter<U>&){};
+    void operator()(T* ptr) {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            if (ptr) {
+                size_t size = *reinterpret_cast<size_t*>(reinterpret_cast<char*>(ptr) - kCookie);
+                for (size_t i = size; i > 0; --i) {
+                    ptr[i - 1].~T();
+                }
+            }
+        }
+    }
+};
+
+// `MakeUniqueIn<T>(arena, args...)`, or `MakeUniqueIn<E[]>(arena, n)` for `n` value-initialized
+// elements
+template <typename T, typename... Args>
+UniquePtr<T, ArenaDeleter<T>> MakeUniqueIn(Arena& arena, Args&&... args) {
+    if constexpr (std::is_array_v<T>) {
+        static_assert(std::extent_v<T> == 0 && sizeof...(Args) == 1,
+                      "arrays take the number of elements");
+        using ElementType = std::remove_extent_t<T>;
+        size_t size = (static_cast<size_t>(args), ...);
+        size_t cookie = 0;
+        size_t alignment = alignof(ElementType);
+        if constexpr (!std::is_trivially_destructible_v<ElementType>) {
+            cookie = ArenaDeleter<T>::kCookie;
+            alignment = std::max(alignment, alignof(size_t));
+        }
+        if (size > (SIZE_MAX - cookie) / sizeof(ElementType)) {
+            throw std::bad_array_new_length();
+        }
+        auto memory =
+            static_cast<char*>(arena.Allocate(cookie + size * sizeof(ElementType), alignment));
+        auto elements = reinterpret_cast<ElementType*>(memory + cookie);
+        size_t constructed = 0;
+        try {
+            for (; constructed < size; ++constructed) {
+                new (elements + constructed) ElementType();
+            }
+        } catch (...) {
+            for (size_t i = constructed; i > 0; --i) {
+                elements[i - 1].~ElementType();
+            }
+            throw;
+        }
+        if (cookie) {
+            *reinterpret_cast<size_t*>(memory) = size;
+        }
+        return UniquePtr<T, ArenaDeleter<T>>(elements);
+    } else {
+        void* memory = arena.Allocate(sizeof(T), alignof(T));
+        return UniquePtr<T, ArenaDeleter<T>>(new (memory) T(std::forward<Args>(args)...));
+    }
+}
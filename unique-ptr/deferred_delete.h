@@ -0,0 +1,242 @@
+#pragma once
+
+#include "per_thread.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>  // size_t
+#include <mutex>
+#include <new>  // std::nothrow
+#include <thread>
+#include <type_traits>
+#include <utility>  // std::swap
+
+struct DeferredReclaimerStats {
+    size_t retired = 0;    // objects handed over so far
+    size_t destroyed = 0;  // objects already destroyed
+    size_t inline_destroyed = 0;  // destroyed on the releasing thread, for lack of a queue node
+    size_t drains = 0;
+    std::chrono::nanoseconds last_drain{0};
+    std::chrono::nanoseconds max_drain{0};
+    std::chrono::nanoseconds total_drain{0};
+
+    // Objects waiting in the queue
+    size_t Depth() const {
+        return retired > destroyed ? retired - destroyed : 0;
+    }
+};
+
+// Lock-free queue of objects whose destruction was moved off the releasing thread.
+// Objects are destroyed by `Drain`, called explicitly or by the background thread.
+// Queue nodes are recycled through per-thread caches and never freed, so `Retire` allocates only
+// until the pool has warmed up and never throws: without a node it destroys the object at once.
+class DeferredReclaimer {
+public:
+    DeferredReclaimer() = default;
+    DeferredReclaimer(const DeferredReclaimer&) = delete;
+    DeferredReclaimer& operator=(const DeferredReclaimer&) = delete;
+    ~DeferredReclaimer() {
+        Stop();
+        Drain();
+    }
+
+    // Used by `DeferredDelete`. Drained one last time at exit, so do not retire objects from
+    // destructors of other static objects.
+    static DeferredReclaimer& Default() {
+        static DeferredReclaimer reclaimer;
+        return reclaimer;
+    }
+
+    template <class T>
+    void Retire(T* object) noexcept {
+        Push(const_cast<std::remove_cv_t<T>*>(object),
+             [](void* ptr) { delete static_cast<T*>(ptr); });
+    }
+    template <class T>
+    void RetireArray(T* objects) noexcept {
+        Push(const_cast<std::remove_cv_t<T>*>(objects),
+             [](void* ptr) { delete[] static_cast<T*>(ptr); });
+    }
+
+    // Destroy everything retired so far, oldest first. Returns the number of destroyed objects.
+    size_t Drain() {
+        auto start = std::chrono::steady_clock::now();
+        Node* list = head_.exchange(nullptr, std::memory_order_acquire);
+        Node* oldest = nullptr;
+        while (list) {
+            Node* next = list->next;
+            list->next = oldest;
+            oldest = list;
+            list = next;
+        }
+        size_t count = 0;
+        for (Node* node = oldest; node; node = node->next) {
+            node->destroy(node->object);
+            ++count;
+        }
+        FreeNodes(oldest);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        // Pairs with `GetStats`, which then sees at least as many objects retired
+        destroyed_.fetch_add(count, std::memory_order_release);
+        drains_.fetch_add(1, std::memory_order_relaxed);
+        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        last_drain_.store(nanoseconds, std::memory_order_relaxed);
+        total_drain_.fetch_add(nanoseconds, std::memory_order_relaxed);
+        auto max = max_drain_.load(std::memory_order_relaxed);
+        while (max < nanoseconds &&
+               !max_drain_.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+        }
+        return count;
+    }
+
+    // Drain every `period` on a background thread until `Stop`
+    void Start(std::chrono::milliseconds period = std::chrono::milliseconds(1)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (worker_.joinable()) {
+            return;
+        }
+        stop_ = false;
+        worker_ = std::thread([this, period] {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_) {
+                lock.unlock();
+                Drain();
+                lock.lock();
+                wakeup_.wait_for(lock, period, [this] { return stop_; });
+            }
+        });
+    }
+    void Stop() {
+        std::thread worker;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            std::swap(worker, worker_);
+        }
+        wakeup_.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    DeferredReclaimerStats GetStats() const {
+        DeferredReclaimerStats stats;
+        stats.destroyed = destroyed_.load(std::memory_order_acquire);
+        stats.retired = retired_.load(std::memory_order_relaxed);
+        stats.inline_destroyed = inline_destroyed_.load(std::memory_order_relaxed);
+        stats.drains = drains_.load(std::memory_order_relaxed);
+        stats.last_drain = std::chrono::nanoseconds(last_drain_.load(std::memory_order_relaxed));
+        stats.max_drain = std::chrono::nanoseconds(max_drain_.load(std::memory_order_relaxed));
+        stats.total_drain = std::chrono::nanoseconds(total_drain_.load(std::memory_order_relaxed));
+        return stats;
+    }
+
+private:
+    struct Node {
+        Node* next;
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    // The calling thread's spare nodes, handed back to the shared list when it exits
+    struct NodeCache {
+        Node* nodes = nullptr;
+
+        ~NodeCache() {
+            FreeNodes(nodes);
+        }
+    };
+
+    void Push(void* object, void (*destroy)(void*)) noexcept {
+        Node* node = NewNode();
+        if (!node) {
+            inline_destroyed_.fetch_add(1, std::memory_order_relaxed);
+            destroy(object);
+            return;
+        }
+        node->object = object;
+        node->destroy = destroy;
+        retired_.fetch_add(1, std::memory_order_relaxed);
+        node->next = head_.load(std::memory_order_relaxed);
+        while (!head_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+        }
+    }
+
+    // From the thread's cache, which takes the whole shared list when it runs dry. Only ever
+    // taking the list as a whole keeps the shared list free of ABA.
+    static Node* NewNode() noexcept {
+        NodeCache* cache = ThreadLocalOrNull<NodeCache>();
+        if (cache) {
+            if (!cache->nodes) {
+                cache->nodes = SpareNodes().exchange(nullptr, std::memory_order_acquire);
+            }
+            if (Node* node = cache->nodes) {
+                cache->nodes = node->next;
+                return node;
+            }
+        }
+        return new (std::nothrow) Node;
+    }
+    // Give a chain of nodes back to the shared list
+    static void FreeNodes(Node* first) noexcept {
+        if (!first) {
+            return;
+        }
+        Node* last = first;
+        while (last->next) {
+            last = last->next;
+        }
+        std::atomic<Node*>& spare = SpareNodes();
+        last->next = spare.load(std::memory_order_relaxed);
+        while (!spare.compare_exchange_weak(last->next, first, std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+        }
+    }
+    // Shared by all reclaimers
+    static std::atomic<Node*>& SpareNodes() noexcept {
+        static std::atomic<Node*> nodes = nullptr;
+        return nodes;
+    }
+
+    std::atomic<Node*> head_ = nullptr;
+    std::atomic<size_t> retired_ = 0;
+    std::atomic<size_t> destroyed_ = 0;
+    std::atomic<size_t> inline_destroyed_ = 0;
+    std::atomic<size_t> drains_ = 0;
+    std::atomic<long long> last_drain_ = 0;
+    std::atomic<long long> max_drain_ = 0;
+    std::atomic<long long> total_drain_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::thread worker_;
+    bool stop_ = false;
+};
+
+// Deleter that hands the object to `DeferredReclaimer::Default()` instead of destroying it.
+// Works with `UniquePtr` and with `SharedPtr(ptr, deleter)`.
+template <class T>
+struct DeferredDelete {
+    DeferredDelete() = default;
+    template <class U>
+    DeferredDelete(const DeferredDelete<U>&){};
+    void operator()(T* ptr) {
+        if (ptr) {
+            DeferredReclaimer::Default().Retire(ptr);
+        }
+    }
+};
+
+template <class T>
+struct DeferredDelete<T[]> {
+    DeferredDelete() = default;
+    template <class U>
+    DeferredDelete(const DeferredDelete<U>&){};
+    void operator()(T* ptr) {
+        if (ptr) {
+            DeferredReclaimer::Default().RetireArray(ptr);
+        }
+    }
+};
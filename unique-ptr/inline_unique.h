@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstddef>  // std::nullptr_t, std::max_align_t
+#include <new>
+#include <type_traits>
+#include <utility>  // std::forward, std::move
+
+// `UniquePtr<Base>` with room for a derived object inside the pointer itself.
+// Objects of up to `N` bytes that fit the alignment and move without throwing are built in
+// place, anything else goes to the heap. A per-type manager function moves and destroys the
+// object, so `Base` does not need a virtual destructor unless `Release` is used.
+// The default `N` makes the whole pointer 64 bytes on 64-bit targets.
+template <typename Base, size_t N = 6 * sizeof(void*), size_t Align = alignof(std::max_align_t)>
+class InlineUniquePtr {
+public:
+    // Whether `InlineUniquePtr` keeps a `D` inline
+    template <class D>
+    static constexpr bool kFitsInline =
+        sizeof(D) <= N && alignof(D) <= Align && std::is_nothrow_move_constructible_v<D>;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    InlineUniquePtr() : ptr_(nullptr), manager_(nullptr){};
+    InlineUniquePtr(std::nullptr_t) : ptr_(nullptr), manager_(nullptr){};
+    // Adopt a heap object, it is deleted as `D`
+    template <class D>
+    explicit InlineUniquePtr(D* ptr) : ptr_(ptr), manager_(ptr ? &Heap<D> : nullptr){};
+    InlineUniquePtr(InlineUniquePtr&& other) noexcept : ptr_(nullptr), manager_(nullptr) {
+        TakeFrom(other);
+    }
+    InlineUniquePtr(const InlineUniquePtr& other) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    InlineUniquePtr& operator=(InlineUniquePtr&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            TakeFrom(other);
+        }
+        return *this;
+    }
+    InlineUniquePtr& operator=(std::nullptr_t) noexcept {
+        Reset();
+        return *this;
+    }
+    InlineUniquePtr& operator=(const InlineUniquePtr& other) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~InlineUniquePtr() {
+        Reset();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    // Replace the object with a `D` built from `args`, inline if it fits
+    template <class D, typename... Args>
+    D* Emplace(Args&&... args) {
+        static_assert(std::is_convertible_v<D*, Base*>, "D has to derive from Base");
+        Reset();
+        D* object;
+        if constexpr (kFitsInline<D>) {
+            object = new (&buffer_) D(std::forward<Args>(args)...);
+            manager_ = &Inline<D>;
+        } else {
+            object = new D(std::forward<Args>(args)...);
+            manager_ = &Heap<D>;
+        }
+        ptr_ = object;
+        return object;
+    }
+
+    // Hand the object over as a heap pointer; an inline object is moved to the heap first.
+    // The caller deletes it as a `Base`, which is only defined with a virtual destructor.
+    Base* Release() {
+        static_assert(std::has_virtual_destructor_v<Base>,
+                      "Release needs a virtual destructor in Base, the caller deletes a Base*");
+        Base* ans = ptr_ ? manager_(Op::kRelease, ptr_, nullptr) : nullptr;
+        ptr_ = nullptr;
+        manager_ = nullptr;
+        return ans;
+    }
+
+    void Reset() {
+        if (ptr_) {
+            Base* old_ptr = ptr_;
+            ptr_ = nullptr;
+            manager_(Op::kDestroy, old_ptr, nullptr);
+            manager_ = nullptr;
+        }
+    }
+    template <class D>
+    void Reset(D* ptr) {
+        Reset();
+        ptr_ = ptr;
+        manager_ = ptr ? &Heap<D> : nullptr;
+    }
+
+    void Swap(InlineUniquePtr& other) noexcept {
+        InlineUniquePtr tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    Base* Get() const {
+        return ptr_;
+    }
+    explicit operator bool() const {
+        return ptr_ != nullptr;
+    }
+    bool IsInline() const {
+        return ptr_ && manager_(Op::kIsInline, ptr_, nullptr);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Single-object dereference operators
+
+    std::add_lvalue_reference_t<Base> operator*() const {
+        return *ptr_;
+    }
+    Base* operator->() const {
+        return ptr_;
+    }
+
+private:
+    enum class Op { kMove, kDestroy, kRelease, kIsInline };
+    // kMove: move the object into `buffer`, return where it is now.
+    // kRelease: return the object as a heap pointer. kIsInline: non-null if it is inline.
+    using Manager = Base* (*)(Op, Base*, void*);
+
+    template <class D>
+    static Base* Inline(Op op, Base* object, void* buffer) {
+        D* self = static_cast<D*>(object);
+        switch (op) {
+            case Op::kMove: {
+                D* moved = new (buffer) D(std::move(*self));
+                self->~D();
+                return moved;
+            }
+            case Op::kDestroy:
+                self->~D();
+                return nullptr;
+            case Op::kRelease: {
+                D* moved = new D(std::move(*self));
+                self->~D();
+                return moved;
+            }
+            case Op::kIsInline:
+                return object;
+        }
+        return nullptr;
+    }
+    template <class D>
+    static Base* Heap(Op op, Base* object, void*) {
+        switch (op) {
+            case Op::kDestroy:
+                delete static_cast<D*>(object);
+                return nullptr;
+            case Op::kIsInline:
+                return nullptr;
+            default:
+                return object;
+        }
+    }
+
+    void TakeFrom(InlineUniquePtr& other) {
+        if (other.ptr_) {
+            ptr_ = other.manager_(Op::kMove, other.ptr_, &buffer_);
+            manager_ = other.manager_;
+            other.ptr_ = nullptr;
+            other.manager_ = nullptr;
+        }
+    }
+
+    Base* ptr_;
+    Manager manager_;
+    std::aligned_storage_t<N, Align> buffer_;
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+// Opt-in statistics of reference-counting traffic, per pointee type.
+// Define SMART_PTRS_INSTRUMENT to have `ControlBlockBase`, `RefCounted` and `UniquePtr` count
+// into per-thread shards, and `RefInstrument::Snapshot()` to add the shards up. Without the
+// macro this header is empty and nothing grows or runs. Counting never allocates or throws, so
+// destructors can count too: shards live in thread-local storage and link themselves into the
+// registry, and type names go into a fixed table. Each thread caches its shard in a plain
+// pointer, and the use count is only sampled, so counting stays a few loads and stores.
+#ifdef SMART_PTRS_INSTRUMENT
+
+#include "per_thread.h"
+
+#include <algorithm>  // std::max
+#include <atomic>
+#include <cstddef>  // size_t
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct RefTypeStats {
+    std::string type;
+    size_t allocations = 0;  // control blocks, intrusive objects or adopted pointers
+    size_t frees = 0;
+    size_t increments = 0;  // strong references taken
+    size_t decrements = 0;
+    size_t weak_increments = 0;
+    size_t weak_decrements = 0;
+    size_t peak_use_count = 0;  // sampled, see `RefInstrument::kPeakSample`
+    size_t weak_extended = 0;   // objects destroyed while weak references kept the block alive
+    size_t released = 0;        // pointers a `UniquePtr` gave up alive, e.g. with `Release`
+
+    size_t Live() const {
+        return allocations - frees - released;
+    }
+};
+
+class RefInstrument {
+public:
+    // Types past the limit are all reported as the last one
+    static constexpr size_t kMaxTypes = 256;
+    // Peaks are looked at on every this many strong increments a thread makes of a type, so
+    // short spikes can be missed. Any allocated type has a peak of at least 1.
+    static constexpr size_t kPeakSample = 64;
+
+    enum Event {
+        kAllocations,
+        kFrees,
+        kIncrements,
+        kDecrements,
+        kWeakIncrements,
+        kWeakDecrements,
+        kWeakExtended,
+        kReleases,
+        kEvents
+    };
+
+    // Dense index of `T`, also fine for incomplete types
+    template <class T>
+    static size_t Id() noexcept {
+        static const size_t id = Register(__PRETTY_FUNCTION__);
+        return id;
+    }
+
+    static void Count(size_t id, Event event) noexcept {
+        if (Shard* shard = GetShard()) {
+            BumpOwned(shard->slots[id].events[event]);
+        } else {
+            CountRetired(id, event);
+        }
+    }
+    // `Count(id, kIncrements)`, true when the caller should also report the use count to
+    // `SeenUseCount`
+    static bool CountIncrement(size_t id) noexcept {
+        Shard* shard = GetShard();
+        if (!shard) {
+            CountRetired(id, kIncrements);
+            return false;
+        }
+        std::atomic<size_t>& increments = shard->slots[id].events[kIncrements];
+        size_t count = increments.load(std::memory_order_relaxed) + 1;
+        increments.store(count, std::memory_order_relaxed);
+        return count % kPeakSample == 0;
+    }
+    static void SeenUseCount(size_t id, size_t use_count) noexcept {
+        if (Shard* shard = GetShard()) {
+            std::atomic<size_t>& peak = shard->slots[id].peak;
+            if (peak.load(std::memory_order_relaxed) < use_count) {
+                peak.store(use_count, std::memory_order_relaxed);
+            }
+        } else {
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.retired[id].peak = std::max(registry.retired[id].peak, use_count);
+        }
+    }
+
+    // Totals over all live threads plus the ones that already exited, one entry per type seen
+    static std::vector<RefTypeStats> Snapshot() {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        std::vector<Totals> totals(registry.retired, registry.retired + registry.types);
+        for (const Shard* shard = registry.shards; shard; shard = shard->next) {
+            for (size_t id = 0; id < totals.size(); ++id) {
+                shard->slots[id].AddTo(totals[id]);
+            }
+        }
+        std::vector<RefTypeStats> ans(totals.size());
+        for (size_t id = 0; id < totals.size(); ++id) {
+            const size_t* events = totals[id].events;
+            ans[id].type = TypeName(registry.names[id]);
+            ans[id].allocations = events[kAllocations];
+            ans[id].frees = events[kFrees];
+            ans[id].increments = events[kIncrements];
+            ans[id].decrements = events[kDecrements];
+            ans[id].weak_increments = events[kWeakIncrements];
+            ans[id].weak_decrements = events[kWeakDecrements];
+            ans[id].weak_extended = events[kWeakExtended];
+            ans[id].released = events[kReleases];
+            ans[id].peak_use_count = std::max<size_t>(totals[id].peak, events[kAllocations] > 0);
+        }
+        return ans;
+    }
+
+private:
+    struct Totals {
+        size_t events[kEvents] = {};
+        size_t peak = 0;
+    };
+
+    // Written only by the owning thread, read by `Snapshot`
+    struct Slot {
+        std::atomic<size_t> events[kEvents] = {};
+        std::atomic<size_t> peak = 0;
+
+        void AddTo(Totals& totals) const {
+            for (size_t event = 0; event < kEvents; ++event) {
+                totals.events[event] += events[event].load(std::memory_order_relaxed);
+            }
+            totals.peak = std::max(totals.peak, peak.load(std::memory_order_relaxed));
+        }
+    };
+
+    struct Shard;
+
+    struct Registry {
+        std::mutex mutex;
+        const char* names[kMaxTypes] = {};
+        size_t types = 0;
+        Shard* shards = nullptr;  // of the live threads
+        Totals retired[kMaxTypes];
+    };
+
+    struct Shard {
+        Shard() {
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            next = registry.shards;
+            if (next) {
+                next->prev = this;
+            }
+            registry.shards = this;
+        }
+        ~Shard() {
+            CachedShard() = nullptr;
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            for (size_t id = 0; id < kMaxTypes; ++id) {
+                slots[id].AddTo(registry.retired[id]);
+            }
+            (prev ? prev->next : registry.shards) = next;
+            if (next) {
+                next->prev = prev;
+            }
+        }
+
+        Slot slots[kMaxTypes];
+        Shard* prev = nullptr;
+        Shard* next = nullptr;
+    };
+
+    // Threads that already destroyed their shard count straight into the totals
+    static void CountRetired(size_t id, Event event) noexcept {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        ++registry.retired[id].events[event];
+    }
+
+    static size_t Register(const char* name) noexcept {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (registry.types == kMaxTypes) {
+            registry.names[kMaxTypes - 1] = "T = (other types)]";
+            return kMaxTypes - 1;
+        }
+        registry.names[registry.types] = name;
+        return registry.types++;
+    }
+
+    // Cut `T = ...` out of the signature `Id` was given
+    static std::string TypeName(const char* signature) {
+        std::string name(signature);
+        size_t begin = name.find("T = ");
+        if (begin == std::string::npos) {
+            return name;
+        }
+        begin += 4;
+        size_t end = name.find(';', begin);
+        if (end == std::string::npos) {
+            end = name.rfind(']');
+        }
+        return name.substr(begin, end - begin);
+    }
+
+    static Registry& GetRegistry() noexcept {
+        return NeverDestroyed<Registry>();
+    }
+    // Looked up once per thread; the cached pointer has no guard to check on every event
+    static Shard* GetShard() noexcept {
+        Shard*& shard = CachedShard();
+        if (!shard) {
+            shard = ThreadLocalOrNull<Shard>();
+        }
+        return shard;
+    }
+    static Shard*& CachedShard() noexcept {
+        thread_local Shard* shard = nullptr;
+        return shard;
+    }
+};
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>  // size_t
+#include <new>
+
+// Building blocks for per-thread state that other threads add up: the calling thread's own
+// instance of something, counters only that thread writes, and the process-wide object the
+// instances report to.
+
+// The calling thread's `T`, default-constructed on first use. nullptr once the thread has
+// started destroying its thread-locals, so that code running from other thread-local destructors
+// does not bring a destroyed `T` back. `~T` does whatever the thread has to hand over when it
+// exits.
+template <class T>
+T* ThreadLocalOrNull() {
+    thread_local bool dead = false;
+    struct Holder {
+        T value;
+        ~Holder() {
+            dead = true;
+        }
+    };
+    if (dead) {
+        return nullptr;
+    }
+    thread_local Holder holder;
+    return &holder.value;
+}
+
+// Increment a counter that only its own thread writes; readers on other threads may see any
+// value it had
+inline void BumpOwned(std::atomic<size_t>& counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// The one `T` for `Tag`, built on first use in static storage and never destroyed, so that
+// pointers released during static destruction still find it. Only `T()` can throw.
+template <class T, class Tag = T>
+T& NeverDestroyed() {
+    alignas(T) static unsigned char storage[sizeof(T)];
+    static T* instance = new (storage) T;
+    return *instance;
+}
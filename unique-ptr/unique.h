@@ -1,8 +1,11 @@
 #pragma once
 
 #include "compressed_pair.h"
+#include "instrument.h"
 
-#include <cstddef>  // std::nullptr_t
+#include <cstddef>      // std::nullptr_t
+#include <type_traits>  // std::is_array_v, std::remove_extent_t
+#include <utility>      // std::forward
 
 template <class T>
 struct Slug {
@@ -31,13 +34,18 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
-    explicit UniquePtr(T* ptr = nullptr) : data_(ptr, Deleter()){};
-    UniquePtr(T* ptr, Deleter deleter) : data_(ptr, std::move(deleter)){};
+    explicit UniquePtr(T* ptr = nullptr) : data_(ptr, Deleter()) {
+        Adopted(ptr);
+    }
+    UniquePtr(T* ptr, Deleter deleter) : data_(ptr, std::move(deleter)) {
+        Adopted(ptr);
+    }
     template <class U, class E>
     UniquePtr(UniquePtr<U, E>&& other) noexcept {
         data_.GetFirst() = std::move(other.data_.GetFirst());
         data_.GetSecond() = std::move(other.data_.GetSecond());
         other.data_.GetFirst() = nullptr;
+        Converted<U>(data_.GetFirst());
     }
     UniquePtr(const UniquePtr& other) = delete;
     ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -47,15 +55,16 @@ public:
         if (other.data_.GetFirst() == data_.GetFirst()) {
             return *this;
         }
-        data_.GetSecond()(data_.GetFirst());
+        Destroy(data_.GetFirst());
         data_.GetFirst() = std::move(other.data_.GetFirst());
         data_.GetSecond() = std::move(other.data_.GetSecond());
         other.data_.GetFirst() = nullptr;
+        Converted<U>(data_.GetFirst());
         return *this;
     }
 
     UniquePtr& operator=(std::nullptr_t) noexcept {
-        data_.GetSecond()(data_.GetFirst());
+        Destroy(data_.GetFirst());
         data_.GetFirst() = nullptr;
         return *this;
     }
@@ -65,7 +74,7 @@ public:
     // Destructor
 
     ~UniquePtr() {
-        data_.GetSecond()(data_.GetFirst());
+        Destroy(data_.GetFirst());
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -74,13 +83,15 @@ public:
     T* Release() {
         T* ans = data_.GetFirst();
         data_.GetFirst() = nullptr;
+        Released(ans);
         return ans;
     }
 
     void Reset(T* ptr = nullptr) {
         T* old_ptr = data_.GetFirst();
         data_.GetFirst() = ptr;
-        data_.GetSecond()(old_ptr);
+        Adopted(ptr);
+        Destroy(old_ptr);
     }
 
     void Swap(UniquePtr& other) noexcept {
@@ -114,6 +125,43 @@ public:
     }
 
 private:
+    // Counting hooks for SMART_PTRS_INSTRUMENT, empty otherwise
+    static void Adopted([[maybe_unused]] T* ptr) {
+#ifdef SMART_PTRS_INSTRUMENT
+        if (ptr) {
+            RefInstrument::Count(RefInstrument::Id<T>(), RefInstrument::kAllocations);
+        }
+#endif
+    }
+    // The object lives on but is no longer ours: a transfer out of the statistics of `T`, not
+    // a free
+    static void Released([[maybe_unused]] T* ptr) {
+#ifdef SMART_PTRS_INSTRUMENT
+        if (ptr) {
+            RefInstrument::Count(RefInstrument::Id<T>(), RefInstrument::kReleases);
+        }
+#endif
+    }
+    // A converting move takes the pointer over from the statistics of `U`
+    template <class U>
+    static void Converted([[maybe_unused]] T* ptr) {
+#ifdef SMART_PTRS_INSTRUMENT
+        using From = std::remove_extent_t<U>;
+        if (!std::is_same_v<From, T> && ptr) {
+            RefInstrument::Count(RefInstrument::Id<From>(), RefInstrument::kReleases);
+            Adopted(ptr);
+        }
+#endif
+    }
+    void Destroy(T* ptr) {
+#ifdef SMART_PTRS_INSTRUMENT
+        if (ptr) {
+            RefInstrument::Count(RefInstrument::Id<T>(), RefInstrument::kFrees);
+        }
+#endif
+        data_.GetSecond()(ptr);
+    }
+
     CompressedPair<T*, Deleter> data_;
     template <class U, class E>
     friend class UniquePtr;
@@ -126,13 +174,18 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
-    explicit UniquePtr(T* ptr = nullptr) : data_(ptr, Deleter()){};
-    UniquePtr(T* ptr, Deleter deleter) : data_(ptr, deleter){};
+    explicit UniquePtr(T* ptr = nullptr) : data_(ptr, Deleter()) {
+        Adopted(ptr);
+    }
+    UniquePtr(T* ptr, Deleter deleter) : data_(ptr, deleter) {
+        Adopted(ptr);
+    }
     template <class U, class E>
     UniquePtr(UniquePtr<U, E>&& other) noexcept {
         data_.GetFirst() = std::move(other.data_.GetFirst());
         data_.GetSecond() = std::move(other.data_.GetSecond());
         other.data_.GetFirst() = nullptr;
+        Converted<U>(data_.GetFirst());
     }
     UniquePtr(const UniquePtr& other) = delete;
 
@@ -144,14 +197,15 @@ public:
         if (other.data_.GetFirst() == data_.GetFirst()) {
             return *this;
         }
-        data_.GetSecond()(data_.GetFirst());
+        Destroy(data_.GetFirst());
         data_.GetFirst() = std::move(other.data_.GetFirst());
         data_.GetSecond() = std::move(other.data_.GetSecond());
         other.data_.GetFirst() = nullptr;
+        Converted<U>(data_.GetFirst());
         return *this;
     }
     UniquePtr& operator=(std::nullptr_t) noexcept {
-        data_.GetSecond()(data_.GetFirst());
+        Destroy(data_.GetFirst());
         data_.GetFirst() = nullptr;
         return *this;
     }
@@ -161,7 +215,7 @@ public:
     // Destructor
 
     ~UniquePtr() {
-        data_.GetSecond()(data_.GetFirst());
+        Destroy(data_.GetFirst());
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -170,13 +224,15 @@ public:
     T* Release() {
         T* ans = data_.GetFirst();
         data_.GetFirst() = nullptr;
+        Released(ans);
         return ans;
     }
 
     void Reset(T* ptr = nullptr) {
         T* old_ptr = data_.GetFirst();
         data_.GetFirst() = ptr;
-        data_.GetSecond()(old_ptr);
+        Adopted(ptr);
+        Destroy(old_ptr);
     }
 
     void Swap(UniquePtr& other) noexcept {
@@ -216,7 +272,74 @@ public:
     }
 
 private:
+    // Counting hooks for SMART_PTRS_INSTRUMENT, empty otherwise
+    static void Adopted([[maybe_unused]] T* ptr) {
+#ifdef SMART_PTRS_INSTRUMENT
+        if (ptr) {
+            RefInstrument::Count(RefInstrument::Id<T>(), RefInstrument::kAllocations);
+        }
+#endif
+    }
+    // The object lives on but is no longer ours: a transfer out of the statistics of `T`, not
+    // a free
+    static void Released([[maybe_unused]] T* ptr) {
+#ifdef SMART_PTRS_INSTRUMENT
+        if (ptr) {
+            RefInstrument::Count(RefInstrument::Id<T>(), RefInstrument::kReleases);
+        }
+#endif
+    }
+    // A converting move takes the pointer over from the statistics of `U`
+    template <class U>
+    static void Converted([[maybe_unused]] T* ptr) {
+#ifdef SMART_PTRS_INSTRUMENT
+        using From = std::remove_extent_t<U>;
+        if (!std::is_same_v<From, T> && ptr) {
+            RefInstrument::Count(RefInstrument::Id<From>(), RefInstrument::kReleases);
+            Adopted(ptr);
+        }
+#endif
+    }
+    void Destroy(T* ptr) {
+#ifdef SMART_PTRS_INSTRUMENT
+        if (ptr) {
+            RefInstrument::Count(RefInstrument::Id<T>(), RefInstrument::kFrees);
+        }
+#endif
+        data_.GetSecond()(ptr);
+    }
+
     CompressedPair<T*, Deleter> data_;
     template <class U, class E>
     friend class UniquePtr;
 };
+
+// `MakeUnique<T>(args...)`, or `MakeUnique<E[]>(n)` for `n` value-initialized elements
+template <typename T, typename... Args>
+UniquePtr<T> MakeUnique(Args&&... args) {
+    if constexpr (std::is_array_v<T>) {
+        static_assert(std::extent_v<T> == 0 && sizeof...(Args) == 1,
+                      "arrays take the number of elements");
+        using ElementType = std::remove_extent_t<T>;
+        size_t size = (static_cast<size_t>(args), ...);
+        return UniquePtr<T>(new ElementType[size]());
+    } else {
+        return UniquePtr<T>(new T(std::forward<Args>(args)...));
+    }
+}
+
+// Same as `MakeUnique`, but the object or the elements are default-initialized, so trivial types
+// are left uninitialized
+template <typename T, typename... Args>
+UniquePtr<T> MakeUniqueForOverwrite(Args&&... args) {
+    if constexpr (std::is_array_v<T>) {
+        static_assert(std::extent_v<T> == 0 && sizeof...(Args) == 1,
+                      "arrays take the number of elements");
+        using ElementType = std::remove_extent_t<T>;
+        size_t size = (static_cast<size_t>(args), ...);
+        return UniquePtr<T>(new ElementType[size]);
+    } else {
+        static_assert(sizeof...(Args) == 0, "objects for overwrite take no arguments");
+        return UniquePtr<T>(new T);
+    }
+}